@@ -0,0 +1,536 @@
+/* ******************************************************************
+   Protocol options shared by gbn.c and sr.c.  They differ only in how
+   A times and resends packets and in when B sends a NACK; what follows
+   is the same for both.
+
+   - optional pacing (PACEGAP > 0): A's sends, new and resent, wait in a
+   queue for tokens from a bucket of PACEBURST that refills one token
+   every PACEGAP time units on a timer of its own
+   - optional forward error correction (FEC = k): after every k new data
+   packets A sends a parity packet, their XOR, and B rebuilds a single
+   missing packet of the group from it without waiting for a resend
+   - optional aggregation (MAXPAYLOAD > 20): A packs up to PERPKT messages
+   behind a count byte.  A packet goes when it is full, when nothing is
+   awaiting an ACK, or FLUSHDELAY after its first message, as in Nagle's
+   algorithm, and B delivers its messages one by one
+   - optional flow control (RCVBUF > 0): B's application takes a message
+   from a buffer of RCVBUF every DRAINGAP time units, B drops a packet it
+   has no room for, and every ACK advertises the packets B has room for.
+   With FLOWCONTROL A keeps no more than that awaiting an ACK, and probes
+   a closed window every RTT while it has nothing awaiting an ACK
+   - the window and timeout in use are A_window and A_timeout, which a
+   tuning run (TUNE) sets; WINDOWSIZE is then the largest window tried
+
+   This file holds definitions, not just declarations, and each protocol
+   includes it once.  Before that the protocol defines RTT, WINDOWSIZE,
+   SEQSPACE, NOTINUSE, the ids of the timers PACETIMER, FLUSHTIMER and
+   PROBETIMER, and ComputeChecksum() and IsCorrupted().  After it, the
+   protocol defines timenew(), which starts timing a new packet.
+**********************************************************************/
+
+#define NACKMARK 'N'    /* first payload byte of a NACK; ACKs carry '0' */
+#define PARITYSEQ (-2)  /* seqnum of the parity of the group from packet 0, PARITYSEQ - n from n */
+#define GROUPHASH 2166136261u  /* FNV offset basis, the hash of an empty group */
+#define PERPKT ((MAXPAYLOAD - 1) / 20)  /* messages in a packet, after a count byte, when MAXPAYLOAD > 20 */
+#define PROBESEQ NOTINUSE  /* seqnum of a zero window probe */
+#define PKTMSGS (MAXPAYLOAD > 20 ? PERPKT : 1)  /* most messages in a packet */
+#define BUFSLOTS (RCVBUF > 0 ? RCVBUF : 1)  /* size of B's buffer array, which C cannot make empty */
+
+#if FEC > WINDOWSIZE
+#error "a parity group must fit in the window: FEC <= WINDOWSIZE"
+#endif
+#if MAXPAYLOAD > 20 && MAXPAYLOAD < 2 * 20 + 1
+#error "an aggregated packet must hold two messages: MAXPAYLOAD == 20 or >= 41"
+#endif
+#if MAXPAYLOAD > 20 * 127 + 1
+#error "a packet's message count must fit in its first byte"
+#endif
+#if RCVBUF > 0 && RCVBUF < (MAXPAYLOAD > 20 ? (MAXPAYLOAD - 1) / 20 : 1)
+#error "B's buffer must hold a full packet: RCVBUF >= PERPKT"
+#endif
+
+/* FNV-1a hash of a parity group, one packet at a time.  The checksum is a
+   plain sum, which XOR-rebuilt packets can match by chance: a lost packet
+   rebuilt against a stale one of an earlier sequence number cycle often
+   comes out as a valid earlier message */
+static int grouphash(int h, struct pkt *p)
+{
+  unsigned int u = (unsigned int)h;
+  int i;
+
+  u = (u ^ (unsigned char)p->seqnum) * 16777619u;
+  for ( i=0; i<MAXPAYLOAD ; i++ )
+    u = (u ^ (unsigned char)p->payload[i]) * 16777619u;
+  return (int)u;
+}
+
+
+/********* Sender (A) variables and functions ************/
+
+/* a packet waiting for the pacer to let it out */
+struct paced {
+  int seqnum;                     /* sequence number of the packet */
+  bool resend;                    /* it has been sent before */
+};
+
+struct sender {
+  struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  int tokens;                     /* sends the pacer allows now */
+  bool pacing;                    /* the pacer's timer is running */
+  struct paced queue[WINDOWSIZE]; /* packets waiting for a token, oldest first */
+  int queuefirst, queuecount;     /* array index of the oldest, number waiting */
+  int nackseq;                    /* packet resent for a NACK this timeout, or NOTINUSE */
+  struct pkt parity;              /* XOR of the current group's packets (FEC) */
+  int groupcount;                 /* packets in the current group */
+  struct pkt parities[WINDOWSIZE];/* parity to send after the packet in the same slot */
+  bool hasparity[WINDOWSIZE];     /* that packet ends a group */
+  char pending[MAXPAYLOAD];       /* messages filling the next packet, behind their count */
+  bool flushing;                  /* the flush timer is running */
+  bool flushdue;                  /* it went off while the window was full */
+  int rwnd;                       /* packets B last said it has room for (RCVBUF) */
+  bool probing;                   /* the zero window probe timer is running */
+  bool sacked[WINDOWSIZE];        /* B has the packet in the same slot (Selective Repeat) */
+};
+
+static struct sender *senders;    /* one sender per flow, indexed by curflow */
+
+int A_window = WINDOWSIZE;        /* packets A may have awaiting an ACK */
+double A_timeout = RTT;           /* time A waits for an ACK before resending */
+
+static void timenew(struct sender *, int);  /* the protocol's, after this file */
+
+/* initialise A's window, buffer and sequence number, and the options' state */
+static void initsender(struct sender *s)
+{
+  int i;
+
+  s->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  s->windowfirst = 0;
+  s->windowlast = -1;   /* windowlast is where the last packet sent is stored.
+		     new packets are placed in winlast + 1
+		     so initially this is set to -1
+		   */
+  s->windowcount = 0;
+  s->tokens = PACEBURST;
+  s->pacing = false;
+  s->queuefirst = 0;
+  s->queuecount = 0;
+  s->nackseq = NOTINUSE;
+  s->groupcount = 0;
+  for (i=0; i<MAXPAYLOAD; i++)
+    s->pending[i] = 0;
+  s->flushing = false;
+  s->flushdue = false;
+  s->rwnd = RCVBUF / PKTMSGS;
+  s->probing = false;
+  for (i=0; i<WINDOWSIZE; i++)
+    s->sacked[i] = false;
+}
+
+/* the most packets A may have awaiting an ACK: the window, or with flow
+   control what B last said it has room for, if that is less */
+static int sendwindow(struct sender *s)
+{
+  if (RCVBUF > 0 && FLOWCONTROL && s->rwnd < A_window)
+    return s->rwnd;
+  return A_window;
+}
+
+/* send the queued packets that B still lacks while tokens last, and
+   keep the pacer's timer running until the bucket is full again */
+static void pace(struct sender *s)
+{
+  struct paced p;
+  int i;
+
+  while (s->tokens > 0 && s->queuecount > 0) {
+    p = s->queue[s->queuefirst];
+    s->queuefirst = (s->queuefirst + 1) % WINDOWSIZE;
+    s->queuecount--;
+    for (i=0; i<s->windowcount; i++)
+      if (s->buffer[(s->windowfirst+i) % WINDOWSIZE].seqnum == p.seqnum &&
+          !s->sacked[(s->windowfirst+i) % WINDOWSIZE]) {
+        tolayer3(A, s->buffer[(s->windowfirst+i) % WINDOWSIZE]);
+        if (p.resend)
+          packets_resent++;
+        else if (FEC > 0 && s->hasparity[(s->windowfirst+i) % WINDOWSIZE]) {
+          /* the parity goes right behind, on credit */
+          tolayer3(A, s->parities[(s->windowfirst+i) % WINDOWSIZE]);
+          s->tokens--;
+        }
+        s->tokens--;
+        break;
+      }
+  }
+  if (s->tokens < PACEBURST && !s->pacing) {
+    starttimer_id(A, PACETIMER, PACEGAP);
+    s->pacing = true;
+  }
+}
+
+/* add the newest packet of the window to the parity group, and when that
+   completes the group keep the parity to follow the packet out.  The
+   parity's acknum carries a hash of the whole group, by which B checks
+   the packet it rebuilds */
+static void addtogroup(struct sender *s)
+{
+  struct pkt *p = &s->buffer[s->windowlast];
+  int i;
+
+  if (s->groupcount == 0) {
+    s->parity.seqnum = PARITYSEQ - p->seqnum;
+    s->parity.acknum = (int)GROUPHASH;
+    for ( i=0; i<MAXPAYLOAD ; i++ )
+      s->parity.payload[i] = 0;
+  }
+  s->parity.acknum = grouphash(s->parity.acknum, p);
+  for ( i=0; i<MAXPAYLOAD ; i++ )
+    s->parity.payload[i] ^= p->payload[i];
+  s->hasparity[s->windowlast] = false;
+
+  if (++s->groupcount == FEC) {
+    s->parity.checksum = ComputeChecksum(s->parity);
+    s->parities[s->windowlast] = s->parity;
+    s->hasparity[s->windowlast] = true;
+    s->groupcount = 0;
+  }
+}
+
+/* hand a packet of the window to the pacer, unless it is already waiting */
+static void queuesend(struct sender *s, int seqnum, bool resend)
+{
+  int i;
+
+  for (i=0; i<s->queuecount; i++)
+    if (s->queue[(s->queuefirst+i) % WINDOWSIZE].seqnum == seqnum)
+      return;
+  s->queue[(s->queuefirst + s->queuecount) % WINDOWSIZE].seqnum = seqnum;
+  s->queue[(s->queuefirst + s->queuecount) % WINDOWSIZE].resend = resend;
+  s->queuecount++;
+  pace(s);
+}
+
+/* put a new packet with MAXPAYLOAD bytes of payload in the window and send it */
+static void sendnew(struct sender *s, char *payload)
+{
+  struct pkt sendpkt;
+  int i;
+
+  /* create packet */
+  sendpkt.seqnum = s->A_nextseqnum;
+  sendpkt.acknum = NOTINUSE;
+  for ( i=0; i<MAXPAYLOAD ; i++ )
+    sendpkt.payload[i] = payload[i];
+  sendpkt.checksum = ComputeChecksum(sendpkt);
+
+  /* put packet in window buffer */
+  /* windowlast will always be 0 for alternating bit; but not for GoBackN */
+  s->windowlast = (s->windowlast + 1) % WINDOWSIZE;
+  s->buffer[s->windowlast] = sendpkt;
+  s->windowcount++;
+  if (FEC > 0)
+    addtogroup(s);
+
+  /* send out packet */
+  if (TRACE > 0)
+    printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  if (PACEGAP > 0)
+    queuesend(s, sendpkt.seqnum, false);
+  else {
+    tolayer3 (A, sendpkt);
+    if (FEC > 0 && s->hasparity[s->windowlast])
+      tolayer3 (A, s->parities[s->windowlast]);
+  }
+  timenew(s, sendpkt.seqnum);
+
+  /* get next sequence number, wrap back to 0 */
+  s->A_nextseqnum = (s->A_nextseqnum + 1) % SEQSPACE;
+}
+
+/* send the packet being filled, and start the next one empty */
+static void flush(struct sender *s)
+{
+  int i;
+
+  if (s->flushing) {
+    stoptimer_id(A, FLUSHTIMER);
+    s->flushing = false;
+  }
+  s->flushdue = false;
+  if (TRACE > 0)
+    printf("----A: sending %d messages in one packet\n", s->pending[0]);
+  sendnew(s, s->pending);
+  for ( i=0; i<MAXPAYLOAD ; i++ )
+    s->pending[i] = 0;
+}
+
+/* aggregating: the message joins the packet being filled, which goes at
+   once if it is full or nothing awaits an ACK, and otherwise when the
+   flush timer goes off or an ACK opens the window */
+static void aggregate(struct sender *s, struct msg *message)
+{
+  int i;
+
+  if (s->pending[0] == PERPKT) {
+    if (TRACE > 0)
+      printf("----A: New message arrives, send window and next packet are full\n");
+    window_full++;
+    return;
+  }
+  for ( i=0; i<20 ; i++ )
+    s->pending[1 + 20*s->pending[0] + i] = message->data[i];
+  s->pending[0]++;
+  if (s->windowcount < sendwindow(s) && (s->pending[0] == PERPKT || s->windowcount == 0))
+    flush(s);
+  else if (!s->flushing) {
+    starttimer_id(A, FLUSHTIMER, FLUSHDELAY);
+    s->flushing = true;
+  }
+}
+
+/* with B's buffer full and nothing awaiting an ACK, no ACK will come to
+   say when B has room again, so A probes every RTT until one does */
+static void probe(struct sender *s)
+{
+  if (s->rwnd == 0 && s->windowcount == 0 && !s->probing) {
+    starttimer_id(A, PROBETIMER, RTT);
+    s->probing = true;
+  }
+  else if ((s->rwnd > 0 || s->windowcount > 0) && s->probing) {
+    stoptimer_id(A, PROBETIMER);
+    s->probing = false;
+  }
+}
+
+/* after an ACK: the window, or B's buffer, may have room for the packet
+   being filled, and a closed window may need probing */
+static void acked(struct sender *s)
+{
+  if (MAXPAYLOAD > 20 && s->pending[0] > 0 && s->windowcount < sendwindow(s) &&
+      (s->flushdue || s->pending[0] == PERPKT || s->windowcount == 0))
+    flush(s);
+
+  if (RCVBUF > 0 && FLOWCONTROL)
+    probe(s);
+}
+
+/* the options' timers: the pacer's adds a token, the aggregator's sends
+   the packet being filled, and flow control's probes a closed window.
+   Returns false if id is none of them */
+static bool optiontimer(struct sender *s, int id)
+{
+  struct pkt probepkt;
+  int i;
+
+  if (id == PACETIMER) {
+    s->pacing = false;
+    s->tokens++;
+    pace(s);
+  }
+  else if (id == FLUSHTIMER) {
+    s->flushing = false;
+    if (s->windowcount < sendwindow(s))
+      flush(s);
+    else
+      s->flushdue = true;
+  }
+  else if (id == PROBETIMER) {
+    s->probing = false;
+    if (s->rwnd == 0 && s->windowcount == 0) {
+      if (TRACE > 0)
+        printf("----A: B has no room, sending a zero window probe\n");
+      probepkt.seqnum = PROBESEQ;
+      probepkt.acknum = NOTINUSE;
+      for ( i=0; i<MAXPAYLOAD ; i++ )
+        probepkt.payload[i] = 0;
+      probepkt.checksum = ComputeChecksum(probepkt);
+      tolayer3(A, probepkt);
+      probe(s);
+    }
+  }
+  else
+    return false;
+  return true;
+}
+
+
+/********* Receiver (B)  variables and procedures ************/
+
+struct receiver {
+  int expectedseqnum; /* the sequence number expected next by the receiver */
+  int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+  bool nacked;        /* expectedseqnum has been NACKed */
+  struct pkt got[SEQSPACE]; /* last undamaged data packet of each sequence number (FEC) */
+  char buffer[BUFSLOTS][20];  /* messages waiting for B's application (RCVBUF) */
+  int bufferfirst, buffercount; /* array index of the oldest, number waiting */
+  bool draining;      /* the application's timer is running */
+  bool held[SEQSPACE];  /* got holds that packet, ahead of expectedseqnum (Selective Repeat) */
+  int heldmsgs;       /* messages in the packets held */
+};
+
+static struct receiver *receivers;  /* one receiver per flow, indexed by curflow */
+
+static void initreceiver(struct receiver *r)
+{
+  int i;
+
+  r->expectedseqnum = 0;
+  r->B_nextseqnum = 1;
+  r->nacked = false;
+  r->bufferfirst = 0;
+  r->buffercount = 0;
+  r->draining = false;
+  for (i=0; i<SEQSPACE; i++)
+    r->held[i] = false;
+  r->heldmsgs = 0;
+}
+
+/* the number of messages in a data packet */
+static int messages(struct pkt *p)
+{
+  if (MAXPAYLOAD > 20)
+    return p->payload[0];
+  return 1;
+}
+
+/* whether B's buffer has room for n more messages, besides those of the
+   packets it holds */
+static bool room(struct receiver *r, int n)
+{
+  return RCVBUF == 0 || r->buffercount + r->heldmsgs + n <= RCVBUF;
+}
+
+/* B stops holding a packet, which is now in order, to deliver it */
+static void unhold(struct receiver *r, int seqnum)
+{
+  r->held[seqnum] = false;
+  r->heldmsgs -= messages(&r->got[seqnum]);
+}
+
+/* hand a message to layer 5, or with a receive buffer leave it there for
+   the application, which takes one every DRAINGAP on B's timer */
+static void consume(struct receiver *r, char *data)
+{
+  int i;
+
+  if (RCVBUF == 0) {
+    tolayer5(B, data);
+    return;
+  }
+  for ( i=0; i<20 ; i++ )
+    r->buffer[(r->bufferfirst + r->buffercount) % BUFSLOTS][i] = data[i];
+  r->buffercount++;
+  if (r->buffercount > buffer_peak)
+    buffer_peak = r->buffercount;
+  if (!r->draining) {
+    starttimer(B, DRAINGAP);
+    r->draining = true;
+  }
+}
+
+/* the application takes the oldest message waiting in the receive buffer */
+static void drain(struct receiver *r)
+{
+  r->draining = false;
+  if (r->buffercount == 0)
+    return;
+  tolayer5(B, r->buffer[r->bufferfirst]);
+  r->bufferfirst = (r->bufferfirst + 1) % BUFSLOTS;
+  r->buffercount--;
+  if (r->buffercount > 0) {
+    starttimer(B, DRAINGAP);
+    r->draining = true;
+  }
+}
+
+/* hand the message of a packet, or each of its messages, to layer 5 */
+static void deliver(struct receiver *r, struct pkt *p)
+{
+  int i;
+
+  if (MAXPAYLOAD > 20)
+    for (i=0; i<p->payload[0]; i++)
+      consume(r, &p->payload[1 + 20*i]);
+  else
+    consume(r, p->payload);
+}
+
+/* rebuild the packet B expects from a parity packet and the others of its
+   group, then deliver it and the rest of the group, which B already has.
+   Returns false if the parity cannot help: B is not missing a packet of
+   its group, or lacks another one, so that the group fails the hash, or
+   has no room in its buffer for what it would deliver and does not hold */
+static bool rebuild(struct receiver *r, struct pkt parity)
+{
+  struct pkt p = parity;
+  int first = PARITYSEQ - parity.seqnum;
+  int missing = (r->expectedseqnum - first + SEQSPACE) % SEQSPACE;
+  int h = (int)GROUPHASH;
+  int n = 0;
+  int i, j;
+
+  if (first >= SEQSPACE || missing >= FEC)
+    return false;
+
+  p.seqnum = r->expectedseqnum;
+  p.acknum = NOTINUSE;
+  for (i=0; i<FEC; i++)
+    if (i != missing)
+      for (j=0; j<MAXPAYLOAD; j++)
+        p.payload[j] ^= r->got[(first+i) % SEQSPACE].payload[j];
+  for (i=0; i<FEC; i++)
+    h = grouphash(h, i == missing ? &p : &r->got[(first+i) % SEQSPACE]);
+  if (h != parity.acknum)
+    return false;
+  for (i=missing; i<FEC; i++)
+    if (i == missing || !r->held[(first+i) % SEQSPACE])
+      n += messages(i == missing ? &p : &r->got[(first+i) % SEQSPACE]);
+  if (!room(r, n))
+    return false;
+  p.checksum = ComputeChecksum(p);
+
+  if (TRACE > 0)
+    printf("----B: packet %d is rebuilt from parity\n", p.seqnum);
+  packets_recovered++;
+  deliver(r, &p);
+  for (i=missing+1; i<FEC; i++) {
+    if (r->held[(first+i) % SEQSPACE])
+      unhold(r, (first+i) % SEQSPACE);
+    packets_received++;
+    deliver(r, &r->got[(first+i) % SEQSPACE]);
+  }
+  r->expectedseqnum = (first + FEC) % SEQSPACE;
+  r->nacked = false;
+  return true;
+}
+
+/* finish B's answer to a packet, whose acknum is set: a NACK if nack, and
+   with a receive buffer the seqnum carries the number of packets B has
+   room for.  Then send it */
+static void sendack(struct receiver *r, struct pkt *sendpkt, bool nack)
+{
+  int i;
+
+  /* create packet */
+  if (RCVBUF > 0)
+    sendpkt->seqnum = (RCVBUF - r->buffercount - r->heldmsgs) / PKTMSGS;
+  else {
+    sendpkt->seqnum = r->B_nextseqnum;
+    r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
+  }
+
+  /* we don't have any data to send.  fill payload with 0's */
+  for ( i=0; i<MAXPAYLOAD ; i++ )
+    sendpkt->payload[i] = '0';
+  if (nack)
+    sendpkt->payload[0] = NACKMARK;
+
+  /* computer checksum */
+  sendpkt->checksum = ComputeChecksum(*sendpkt);
+
+  /* send out packet */
+  tolayer3 (B, *sendpkt);
+}
\ No newline at end of file
@@ -33,22 +33,171 @@
    soon as n packets are sent.
    - fixed C style to adhere to current programming style
 
+   Modifications:
+   - the event list is a binary heap, and each channel's latest arrival
+   time is remembered, so no routine scans the list: every event
+   operation is O(log n)
+   - timers live in a hierarchical timing wheel (twheel.c), so arming and
+   cancelling are O(1).  Besides the one starttimer() timer, each entity
+   may run any number of timers named by an id with starttimer_id(); their
+   expiry calls A_timerinterrupt_id()/B_timerinterrupt_id().
+   - MULTIFLOW: N independent sender/receiver pairs (flows), each with its
+   own protocol instance, share a bottleneck link with a finite drop-tail
+   queue in the A->B direction.  The protocol selects its per-flow state
+   with curflow.
+   - AUTOSTOP: the run discards its warm-up and stops once batch-means
+   confidence intervals of goodput and latency reach a requested relative
+   precision (nsimmax remains an upper limit).
+   - simulated time is a 64-bit count of ticks, TICKS_PER_UNIT to the time
+   unit, so event ordering stays exact however long the run; all counters
+   are 64-bit.
+   - PARALLEL: the entities are split into partitions, each with its own
+   event list, timers and random number stream, run by a pool of threads.
+   Every packet takes at least one time unit to cross a channel, so the
+   partitions advance together in windows of one time unit (conservative
+   synchronisation) and hand packets to each other through lock-free
+   single-producer/single-consumer queues.  Results depend on the number
+   of partitions but not on the number of threads.  One partition is the
+   sequential run, number for number; with more, each flow has a fixed
+   share of the messages and the latency, spurious resend and loss
+   recovery accounting, which follows a flow across partitions, is off.
+   - runs on one partition record every message's latency in a log-bucket
+   histogram and report its percentiles.  They also count spurious
+   resends by A: those of a packet whose earlier undamaged copy was still
+   on its way to B, or had reached B and been ACKed with its own
+   sequence number, and time each loss recovery: from the first lost or
+   damaged copy of a data packet until B ACKs it.
+   - PROFILE: the emulator counts events by type, event list lengths, heap
+   nodes visited, timers and allocations, writes a progress line to
+   stderr every second of wall-clock time, and reports the counts and
+   its peak memory at the end.
+   - ARRIVALS: messages may arrive as a Poisson process, in on/off bursts,
+   or as recorded in a trace file that is read through mmap.  Each flow
+   keeps one arrival event and uses it again for every message.
+   - VERIFY: each message carries its number among the messages its flow
+   has accepted, and layer 5 checks that every flow's messages arrive
+   exactly once and in order.  A sliding bitmap of delivered numbers per
+   flow keeps the check O(1) in time and bounded in memory; the first
+   violation is reported with its time.
+   - RELAYS: A and B are joined by a chain of links, each with its own
+   loss, corruption and delay.  The protocol runs either end to end, the
+   relays passing packets on unopened, or on every link, as one flow per
+   link whose B hands each message to the next link's A through a relay
+   queue.
+   - TUNE: the scenario entered is run many times with different seeds to
+   find the protocol's best window and timeout, for goodput or for p99
+   latency.  Successive halving narrows a grid of windows and timeouts
+   down to one configuration, giving the survivors of each round twice
+   the runs; golden-section search then refines its timeout.  All
+   configurations see the same seeds, and the best is reported with a
+   95% confidence interval over its runs.
+   - REPLICAS, parallel replications: many seeded replications of the
+   scenario are run by a process pool.  Each worker process makes its
+   share of the runs one after another.  Nothing is batched or
+   vectorised and the runs share no work, so the pool is faster than
+   one worker only with more processors.
+   What each replication measured goes into a shared array, and the runs
+   report every replication, their means and confidence intervals, and
+   replications per second on the pool against a timed pass of the same
+   runs on one worker.  Replication r is exactly the run built with
+   SEED = 9999 + r.  The replications could not run in lockstep, one
+   vector lane each: from their first random draw they take different
+   events in a different order.
+
    ********************************************************************* */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include "emulator.h"
 #include "gbn.h"
+#include "stats.h"
+#include "twheel.h"
+#if PARALLEL
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+#if PROFILE
+#include <time.h>
+#include <sys/resource.h>
+#endif
+#if REPLICAS
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+#if ARRIVALS == 3
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <math.h>
+
+#define SENTSLOTS 16      /* sequence numbers told apart by the resend check */
+#ifndef SEED
+#define SEED 9999         /* random number seed of a run, or the first of many */
+#endif
 
 struct event {
-  float evtime;           /* event time */
+  simtime_t evtime;       /* event time, in ticks */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
+  int evflow;             /* flow the entity belongs to */
   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
+  unsigned long long evseq;  /* creation order, breaks ties between equal times */
+  int evindex;            /* position of this event in the heap */
+  int evhop;              /* link the packet has crossed (RELAYS) */
+};
+
+#define MAXPARTS 64       /* most partitions PARALLEL may use */
+
+#if PARALLEL
+/* a queue of events from one partition to another.  One thread adds at the
+   tail and another takes from the head, without locks: the producer fills
+   a slot, then publishes it by advancing pushed */
+#define QCHUNK 256
+struct qchunk {
+  struct event *ev[QCHUNK];
+  struct qchunk *next;
+};
+
+struct queue {
+  struct qchunk *tail;      /* producer: chunk being filled */
+  int tailpos;              /* producer: next free slot in it */
+  struct qchunk *head;      /* consumer: chunk being emptied */
+  int headpos;              /* consumer: next slot to take */
+  long long popped;         /* consumer: events taken */
+  _Atomic long long pushed; /* events published by the producer */
+};
+#endif
+
+/* a partition owns some of the entities and everything that happens at
+   them: its event list, its running timers, and its random numbers */
+struct partition {
+  int id;
+  /* the event list: a binary heap ordered by time.  Events with equal times
+     come out most recently created first, as they did from the sorted list */
+  struct event **evlist;
+  int evcount;              /* number of events in the heap */
+  int evsize;               /* allocated size of the heap */
+  unsigned long long evseq; /* sequence number of the next event created */
+  struct twheel wheel;      /* running timers */
+  struct twtimer *twfree;   /* unused timers */
+  simtime_t time;          /* time reached */
+  unsigned long long rng;   /* random number state (PARALLEL) */
+#if PARALLEL
+  struct queue in[MAXPARTS];  /* events sent here by each partition */
+  simtime_t next;           /* earliest pending time, between windows */
+#endif
 };
 
-struct event *evlist = NULL;   /* the event list */
+static struct partition parts[MAXPARTS];
+static int nparts = 1;            /* number of partitions */
+static int nthreads = 1;          /* threads running the partitions */
+static long long nwindows;        /* synchronisation windows run */
+static THREADLOCAL long long ncrossed;  /* events handed between partitions */
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
@@ -58,42 +207,245 @@ struct event *evlist = NULL;   /* the event list */
 #define  OFF             0
 #define  ON              1
 
+/* arrival processes, for ARRIVALS */
+#define  UNIFORM         0  /* uniform on [0, 2*lambda] between messages */
+#define  POISSON         1  /* exponential with mean lambda */
+#define  ONOFF           2  /* Poisson during on periods, none during off */
+#define  TRACEFILE       3  /* replayed from a trace file */
+
+/* a trace file: a header, then count records in time order.  A record's
+   payload is length bytes found at offset in the same file */
+struct tracehead {
+  char magic[8];            /* "CNATRACE" */
+  long long count;          /* number of records */
+};
+
+struct tracerec {
+  double time;              /* arrival time, in time units */
+  int flow;                 /* flow the message is for, modulo nflows */
+  int length;               /* payload bytes, at most 20; 0 for the usual letters */
+  long long offset;         /* where the payload bytes are */
+};
+
 int TRACE = 3;
 
+/* each thread counts for itself; the counts are summed at the end */
+
 /* statistics updated by GBN */
-int window_full;   /* count of the number of messages dropped due to full window */
-int total_ACKs_received;
-int packets_resent;       /* count of the number of packets resent  */
-int new_ACKs;           /* count of the number of acks correctly received */
-int packets_received;  /* count of the packets received by receiver */
+THREADLOCAL long long window_full;   /* count of the number of messages dropped due to full window */
+THREADLOCAL long long total_ACKs_received;
+THREADLOCAL long long packets_resent;       /* count of the number of packets resent  */
+THREADLOCAL long long new_ACKs;           /* count of the number of acks correctly received */
+THREADLOCAL long long packets_received;  /* count of the packets received by receiver */
+THREADLOCAL long long packets_recovered; /* count of the packets the receiver rebuilt from parity */
+THREADLOCAL long long packets_refused; /* count of the packets the receiver dropped for a full buffer */
+THREADLOCAL long long buffer_peak;     /* most messages waiting in any receive buffer */
 
 /* statistics updated by emulator */
-static int packets_lost;  
-static int packets_corrupt;
-static int packets_sent;
-static int packets_timeout;
-static int messages_delivered;
-
-static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
-static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
+static THREADLOCAL long long messages_delivered;
+
+static THREADLOCAL long long nsim = 0;  /* number of messages from 5 to 4 so far */ 
+static long long nsimmax = 0;     /* number of msgs to generate, then stop */
+static THREADLOCAL simtime_t now = 0;  /* current time, in ticks */
+static THREADLOCAL struct partition *part;  /* partition being run */
 static float lossprob;            /* probability that a packet is dropped  */
 static float corruptprob;   /* probability that one bit is packet is flipped */
 static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
 static float lambda;        /* arrival rate of messages from layer 5 */   
-static int   ntolayer3;           /* number sent into layer 3 */
-static int   nlost;               /* number lost in media */
-static int ncorrupt;              /* number corrupted by media*/
+static THREADLOCAL long long ntolayer3;  /* number sent into layer 3 */
+static THREADLOCAL long long nlost;      /* number lost in media */
+static THREADLOCAL long long ncorrupt;   /* number corrupted by media*/
+
+/* flows: one sender/receiver pair each */
+int nflows = 1;                   /* number of flows */
+THREADLOCAL int curflow = 0;      /* flow whose entity is being called */
+
+/* the latest packet A sent with some sequence number, and what became of
+   its undamaged copies */
+struct sent {
+  struct pkt pkt;
+  int inflight;             /* copies on their way to B */
+  int held;                 /* B has ACKed one */
+  simtime_t losttime;       /* when the first copy was lost or damaged, or -1 */
+};
+
+/* delivery checking (VERIFY).  next is one past the highest message
+   number delivered; a number skipped on the way there counts as missing
+   until it arrives.  seen is a circular bitmap of the numbers from
+   next - VBITS to next - 1: bit n % VBITS is set once message n has
+   arrived.  Older numbers cannot be told apart as late or repeated */
+#define VBITS 1024
+#define VDIGITS 12        /* message number digits at the end of the data */
+
+struct verifier {
+  long long next;           /* one past the highest message number delivered */
+  unsigned long long seen[VBITS / 64];
+  long long missing;        /* numbers below next not delivered */
+  long long unchecked;      /* deliveries of numbers below next - VBITS */
+  long long violations;     /* deliveries out of order, repeated or garbled */
+  simtime_t firsttime;      /* time of the first violation */
+  const char *firstkind;    /* what it was */
+  long long firstgot;       /* number delivered then, -1 if garbled */
+  long long firstwanted;    /* number expected then */
+};
+
+struct flow {
+  struct twtimer *timer[2]; /* running starttimer() timer of A and B, or NULL */
+  struct twtimer **idtimer[2];  /* running starttimer_id() timers, by id */
+  int nidtimer[2];          /* size of idtimer[] */
+  simtime_t lastarrival[2]; /* latest arrival time scheduled towards A and B */
+  long long nsim;           /* messages generated for this flow */
+  long long ntolayer3[2];   /* packets sent into layer 3 by A and by B */
+  long long nlost[2];       /* packets from A and from B lost in media */
+  long long ndropped;       /* packets dropped by the bottleneck queue */
+  long long delivered;      /* messages delivered to the application */
+  simtime_t *gentime;       /* generation times of accepted, undelivered msgs */
+  int ghead, gcount, gsize; /* ring buffer state of gentime */
+  struct sent *sent;        /* A's latest packets, by sequence number */
+  struct event *arrival;    /* the flow's message arrival event */
+  long long accepted;       /* messages A has accepted (VERIFY) */
+  struct verifier *verify;  /* delivery check (VERIFY) */
+  simtime_t onend;          /* end of the current on period (ONOFF) */
+  struct msg *relayq;       /* messages waiting for this link's A (RELAYS) */
+  int rhead, rcount, rsize; /* ring buffer state of relayq */
+  int rpeak;                /* most messages waiting at once */
+};
+
+static struct flow *flows = NULL;
+
+/* one link of a relay path (RELAYS).  Nodes 0 (A) to nlinks (B) sit at
+   its ends: link k joins node k to node k + 1 */
+struct link {
+  float lossprob;           /* as for the single channel */
+  float corruptprob;
+  float maxdelay;           /* a packet takes 1 to maxdelay time units */
+  simtime_t lastarrival[2]; /* latest arrival scheduled towards A and B */
+  long long nsent, nlost, ncorrupt;
+};
+
+static struct link *links = NULL;
+static int nlinks = 1;
+static int hopbyhop = 0;          /* the protocol runs on every link */
+
+/* what the emulator itself does (PROFILE) */
+struct profile {
+  long long events[3];      /* events simulated, by type */
+  long long evlistsum;      /* event list length, summed over the events */
+  int evlistmax;            /* longest the event list has been */
+  long long visited;        /* heap nodes moved past while sifting */
+  long long armed, disarmed;    /* timers started and stopped */
+  long long allocs;         /* blocks allocated */
+  long long allocbytes;     /* bytes in them */
+  double wallstart;         /* wall-clock seconds at the start */
+  double lastprogress;      /* wall-clock seconds at the last progress line */
+};
+
+static struct profile prof;
+
+static void allocated(size_t bytes)
+{
+  prof.allocs++;
+  prof.allocbytes += bytes;
+}
+
+/* wall-clock seconds (PROFILE, REPLICAS) */
+static double wallclock(void)
+{
+#if PROFILE || REPLICAS
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+#else
+  return 0.0;
+#endif
+}
+
+/* latency and resend accounting of sequential runs */
+static struct lathist lathist;    /* latency of every delivered message */
+static long long nspurious;       /* resends of packets that were not lost */
+static struct lathist rechist;    /* loss recovery time of each data packet */
+static struct pkt *arriving;      /* packet being handed to B_input, or NULL */
+
+/* the bottleneck link shared by all flows in the A->B direction.  It is a
+   FIFO server with a fixed service time per packet and room for bnqueue
+   packets (including the one in service); bnqueue 0 disables it */
+static int bnqueue = 0;           /* capacity of the drop-tail queue */
+static simtime_t bnservice = 0;   /* time to serve one packet */
+static simtime_t bnfree = 0;      /* time the link finishes its backlog */
+static THREADLOCAL long long bndropped = 0;  /* packets dropped by the full queue */
+
+/* arrivals */
+static float onmean, offmean;     /* mean on and off period (ONOFF) */
+static char tracename[256];       /* trace file (TRACEFILE) */
+static const char *tracemap;      /* the trace file, mapped */
+static long long tracesize;       /* bytes in it */
+static const struct tracerec *tracerecs;  /* its records */
+static long long tracecount;      /* number of records */
+static long long tracenext;       /* next record to schedule */
+static struct event *traceevent;  /* the arrival event replaying the trace */
+
+/* statistical stopping */
+static float precision;           /* target relative CI half width */
+static int batchsize;             /* deliveries per mini-batch */
+static struct batchmeans bm;      /* goodput and latency batch means */
+static int stopnow = 0;           /* precision reached, end the run */
+
+/* tuning (TUNE) */
+#define TUNETIMEOUTS 8    /* timeouts tried with each window, evenly spaced in log */
+#define TUNESTEPS 10      /* golden-section steps refining the best timeout */
+static float tunelo, tunehi;      /* smallest and largest timeout tried */
+static int tunereps;              /* runs of each configuration in the first round */
+static long long ntuneruns;       /* runs made */
+
+/* what a replication measured (REPLICAS).  Replication r fills element r
+   of an array in memory shared with the worker processes */
+struct result {
+  long long delivered;      /* messages delivered to the application */
+  long long refused;        /* messages dropped due to full window */
+  long long resent;         /* packet resends by A */
+  long long sent;           /* packets sent into layer 3 */
+  double endtime;           /* time the run ended */
+  double p99;               /* p99 latency of delivered messages */
+};
+
+static int nreplicas;             /* replications to run */
+static int nworkers;              /* processes running them */
+
+/* conversions between time units, as used at the prompts and by the timer
+   routines, and the ticks the emulator counts in */
+simtime_t units2ticks(double units)
+{
+  return ((simtime_t)(units * TICKS_PER_UNIT + 0.5));
+}
+
+double ticks2units(simtime_t ticks)
+{
+  return ((double)ticks / TICKS_PER_UNIT);
+}
 
 /****************************************************************************/
 /* jimsrand(): return a double in range [0,1].  The routine below is used to */
 /* isolate all random number generation in one location.  We assume that the*/
 /* system-supplied rand() function return an int in therange [0,mmm]        */
 /****************************************************************************/
+/* With several partitions each draws from its own xorshift64* stream    */
+/* instead, so that its numbers do not depend on the other partitions.    */
+/****************************************************************************/
 double jimsrand(void) 
 {
-  double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
   double x;                   
+  double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
+
+#if PARALLEL
+  if (nparts > 1) {
+    part->rng ^= part->rng >> 12;
+    part->rng ^= part->rng << 25;
+    part->rng ^= part->rng >> 27;
+    x = (part->rng * 2685821657736338717ULL >> 11) / 9007199254740991.0;
+  }
+  else
+#endif
   x = rand()/mmm;            /* x should be uniform in [0,1] */
   if (TRACE > 3)
     printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
@@ -104,60 +456,283 @@ double jimsrand(void)
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
-void insertevent(struct event *p)
+/* is event p due before event q? */
+static int evbefore(struct event *p, struct event *q)
+{
+  if (p->evtime != q->evtime)
+    return (p->evtime < q->evtime);
+  return (p->evseq > q->evseq);
+}
+
+static void evplace(struct event *p, int i)
 {
-  struct event *q,*qold;
+  part->evlist[i] = p;
+  p->evindex = i;
+}
 
-  if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+static void siftup(int i)
+{
+  struct event **evlist = part->evlist;
+  struct event *p = evlist[i];
+
+  while (i > 0 && evbefore(p, evlist[(i-1)/2])) {
+    evplace(evlist[(i-1)/2], i);
+    i = (i-1)/2;
+    if (PROFILE)
+      prof.visited++;
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
+  evplace(p, i);
+}
+
+static void siftdown(int i)
+{
+  struct event **evlist = part->evlist;
+  struct event *p = evlist[i];
+  int child;
+
+  while ((child = 2*i + 1) < part->evcount) {
+    if (child+1 < part->evcount && evbefore(evlist[child+1], evlist[child]))
+      child++;
+    if (!evbefore(evlist[child], p))
+      break;
+    evplace(evlist[child], i);
+    i = child;
+    if (PROFILE)
+      prof.visited++;
   }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
+  evplace(p, i);
+}
+
+/* put p in the current partition's event list */
+static void heapinsert(struct event *p)
+{
+  if (part->evcount == part->evsize) {
+    part->evsize = part->evsize ? 2*part->evsize : 64;
+    part->evlist = realloc(part->evlist, part->evsize * sizeof(struct event *));
+    if (part->evlist == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (PROFILE)
+      allocated(part->evsize * sizeof(struct event *));
+  }
+  evplace(p, part->evcount++);
+  siftup(p->evindex);
+}
+
+/* take event p out of the event list */
+static void removeevent(struct event *p)
+{
+  int i = p->evindex;
+
+  part->evcount--;
+  if (i == part->evcount)
+    return;
+  evplace(part->evlist[part->evcount], i);
+  if (i > 0 && evbefore(part->evlist[i], part->evlist[(i-1)/2]))
+    siftup(i);
+  else
+    siftdown(i);
+}
+
+/* the partition an entity belongs to.  A flow's A and B are kept apart so
+   that packets between them cross partitions.  With a bottleneck, every A
+   shares it, so all of them stay in partition 0 */
+static int partof(int flow, int AorB)
+{
+  int na;
+
+  if (nparts == 1)
+    return 0;
+  na = bnqueue > 0 ? 1 : nparts / 2;
+  if (AorB == A)
+    return (flow % na);
+  return (na + flow % (nparts - na));
+}
+
+#if PARALLEL
+static void enqueue(struct queue *q, struct event *p)
+{
+  struct qchunk *c;
+
+  if (q->tail == NULL) {
+    q->tail = q->head = calloc(1, sizeof(struct qchunk));
+    if (q->tail == 0) {
+      printf("memory allocation for event queue failed.");
+      exit(EXIT_FAILURE);
     }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
+  }
+  q->tail->ev[q->tailpos++] = p;
+  if (q->tailpos == QCHUNK) {
+    c = calloc(1, sizeof(struct qchunk));
+    if (c == 0) {
+      printf("memory allocation for event queue failed.");
+      exit(EXIT_FAILURE);
     }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+    q->tail->next = c;
+    q->tail = c;
+    q->tailpos = 0;
+  }
+  atomic_store_explicit(&q->pushed, atomic_load_explicit(&q->pushed, memory_order_relaxed) + 1,
+                        memory_order_release);
+}
+
+/* move everything other partitions have sent into the event list */
+static void drainqueues(void)
+{
+  struct queue *q;
+  struct qchunk *c;
+  long long pushed;
+  int i;
+
+  for (i = 0; i < nparts; i++) {
+    q = &part->in[i];
+    pushed = atomic_load_explicit(&q->pushed, memory_order_acquire);
+    while (q->popped < pushed) {
+      heapinsert(q->head->ev[q->headpos++]);
+      q->popped++;
+      if (q->headpos == QCHUNK) {
+        c = q->head;
+        q->head = c->next;
+        q->headpos = 0;
+        free(c);
+      }
     }
   }
 }
+#endif
+
+/* schedule event p at its entity, which may belong to another partition */
+void insertevent(struct event *p)
+{
+  int dest = partof(p->evflow, p->eventity);
+
+  if (TRACE>2) {
+    printf("            INSERTEVENT: time is %f\n",ticks2units(now));
+    printf("            INSERTEVENT: future time will be %f\n",ticks2units(p->evtime)); 
+  }
+  /* the creating partition numbers its events, so ties between partitions
+     are broken the same way however the threads interleave */
+  p->evseq = part->evseq++ * MAXPARTS + part->id;
+#if PARALLEL
+  if (dest != part->id) {
+    ncrossed++;
+    enqueue(&parts[dest].in[part->id], p);
+    return;
+  }
+#endif
+  (void)dest;
+  heapinsert(p);
+}
+
+/* exponentially distributed with the given mean */
+static double expdraw(double mean)
+{
+  double u = jimsrand();
+
+  if (u >= 1.0)
+    u = 0.999999;
+  return (-mean * log(1.0 - u));
+}
+
+/* time until flow f's next message with on/off arrivals: Poisson during
+   on periods, nothing during off periods.  All three are exponential, so
+   an arrival that would fall after the on period ends is drawn again
+   from the start of the next one */
+static simtime_t onoffdraw(struct flow *f)
+{
+  simtime_t t = now + units2ticks(expdraw(lambda));
+
+  while (t > f->onend) {
+    t = f->onend + units2ticks(expdraw(offmean));
+    f->onend = t + units2ticks(expdraw(onmean));
+    t += units2ticks(expdraw(lambda));
+  }
+  return (t - now);
+}
 
-void generate_next_arrival(void)
+#if ARRIVALS == TRACEFILE
+/* map the trace file and check its header */
+static void opentrace(void)
 {
-  double x;
+  const struct tracehead *head;
+  struct stat st;
+  int fd;
+
+  fd = open(tracename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("cannot open trace file %s.\n", tracename);
+    exit(EXIT_FAILURE);
+  }
+  tracesize = st.st_size;
+  if (tracesize < (long long)sizeof(struct tracehead)) {
+    printf("trace file %s is too short.\n", tracename);
+    exit(EXIT_FAILURE);
+  }
+  tracemap = mmap(NULL, tracesize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (tracemap == MAP_FAILED) {
+    printf("cannot map trace file %s.\n", tracename);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  madvise((void *)tracemap, tracesize, MADV_SEQUENTIAL);
+
+  head = (const struct tracehead *)tracemap;
+  tracecount = head->count;
+  if (memcmp(head->magic, "CNATRACE", 8) != 0 || tracecount < 0 ||
+      tracecount > (tracesize - (long long)sizeof(struct tracehead)) / (long long)sizeof(struct tracerec)) {
+    printf("%s is not a trace file.\n", tracename);
+    exit(EXIT_FAILURE);
+  }
+  tracerecs = (const struct tracerec *)(tracemap + sizeof(struct tracehead));
+}
+#endif
+
+/* schedule the flow's next message.  Every flow has one arrival event,
+   used again each time; a replayed trace has one for all the flows, and
+   stops scheduling at its last record */
+void generate_next_arrival(int flow)
+{
+  double x = 0.0;
   struct event *evptr;
+  struct event **slot = ARRIVALS == TRACEFILE ? &traceevent : &flows[flow].arrival;
 
   if (TRACE>2)
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+  if (ARRIVALS == TRACEFILE && tracenext >= tracecount)
+    return;
+  if (ARRIVALS == UNIFORM)
+    x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
   /* having mean of lambda        */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
+  else if (ARRIVALS == POISSON)
+    x = expdraw(lambda);
+  if (*slot == NULL) {
+    *slot = malloc(sizeof(struct event));
+    if (*slot == 0) {
+      printf("memory allocation for event failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (PROFILE)
+      allocated(sizeof(struct event));
+  }
+  evptr = *slot;
+  if (ARRIVALS == ONOFF)
+    evptr->evtime = now + onoffdraw(&flows[flow]);
+  else if (ARRIVALS == TRACEFILE) {
+    evptr->evtime = units2ticks(tracerecs[tracenext].time);
+    if (evptr->evtime < now)
+      evptr->evtime = now;
+    flow = tracerecs[tracenext].flow % nflows;
+    if (flow < 0)
+      flow += nflows;
+    tracenext++;
   }
-  evptr->evtime =  time + x;
+  else
+    evptr->evtime =  now + units2ticks(x);
   evptr->evtype =  FROM_LAYER5;
+  evptr->evflow = flow;
+  evptr->pktptr = NULL;
   if (BIDIRECTIONAL && (jimsrand()>0.5) )
     evptr->eventity = B;
   else
@@ -165,24 +740,69 @@ void generate_next_arrival(void)
   insertevent(evptr);
 } 
 
+/* the contents of the message arriving now at the current flow: its
+   letter, or the payload of the trace record being replayed, and with
+   VERIFY its number */
+static void makemessage(struct msg *m)
+{
+  const struct tracerec *r;
+  long long n;
+  int i;
+
+  for (i=0; i<20; i++)
+    m->data[i] = 97 + flows[curflow].nsim % 26;
+  if (ARRIVALS == TRACEFILE) {
+    r = &tracerecs[tracenext - 1];
+    if (r->length < 0 || r->length > 20 || r->offset < 0 || r->offset > tracesize - r->length) {
+      printf("trace record %lld has a bad payload reference.\n", tracenext - 1);
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<r->length; i++)
+      m->data[i] = tracemap[r->offset + i];
+    for (; i<20 && r->length > 0; i++)
+      m->data[i] = ' ';
+  }
+
+  /* the last VDIGITS characters number the message among those the flow
+     has accepted; a refused message's number goes to the next one */
+  if (VERIFY)
+    for (i=19, n=flows[curflow].accepted; i>=20-VDIGITS; i--, n/=10)
+      m->data[i] = '0' + n % 10;
+}
+
 void printevlist(void)
 {
   struct event *q;
+  int i;
+
   printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  for (i = 0; i < part->evcount; i++) {
+    q = part->evlist[i];
+    printf("Event time: %f, type: %d entity: %d flow: %d\n",ticks2units(q->evtime),q->evtype,q->eventity,q->evflow);
   }
   printf("--------------\n");
 }
 
+/* starting state of partition i's random number stream in a run with
+   the given seed (splitmix64) */
+static unsigned long long seedstream(unsigned int seed, int i)
+{
+  unsigned long long z = seed + 0x9e3779b97f4a7c15ULL * (i + 1);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z != 0 ? z : 1);
+}
+
 void init(void)                         /* initialize the simulator */
 {
-  float sum, avg;
+  float service = 0.0;
   int i;
 
   printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
   printf("Enter the number of messages to simulate: ");
-  scanf("%d",&nsimmax);
+  scanf("%lld",&nsimmax);
   printf("Enter  packet loss probability [enter 0.0 for no loss]:");
   scanf("%f",&lossprob);
   printf("Enter packet corruption probability [0.0 for no corruption]:");
@@ -193,11 +813,152 @@ void init(void)                         /* initialize the simulator */
   }
   printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
   scanf("%f",&lambda);
+  if (MULTIFLOW) {
+    printf("Enter the number of flows sharing the bottleneck [ >= 1]:");
+    scanf("%d",&nflows);
+    printf("Enter the bottleneck queue capacity in packets [0 for no bottleneck]:");
+    scanf("%d",&bnqueue);
+    if (bnqueue > 0) {
+      printf("Enter the bottleneck service time per packet [ > 0.0]:");
+      scanf("%f",&service);
+    }
+  }
+  if (RELAYS) {
+    printf("Enter the number of links from A to B [ >= 1]:");
+    scanf("%d",&nlinks);
+    if (nlinks < 1) {
+      printf("Invalid number of links.\n");
+      exit(EXIT_FAILURE);
+    }
+    links = calloc(nlinks, sizeof(struct link));
+    if (links == 0) {
+      printf("memory allocation for links failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nlinks; i++) {
+      printf("Enter loss probability, corruption probability and largest delay [ >= 1.0] of link %d:", i);
+      scanf("%f %f %f",&links[i].lossprob,&links[i].corruptprob,&links[i].maxdelay);
+      if (links[i].lossprob < 0.0 || links[i].lossprob > 1.0 || links[i].corruptprob < 0.0 ||
+          links[i].corruptprob > 1.0 || links[i].maxdelay < 1.0) {
+        printf("Invalid settings for link %d.\n", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+    printf("Enter 0 to run the protocol end to end, 1 to run it on every link:");
+    scanf("%d",&hopbyhop);
+    if (hopbyhop)
+      nflows = nlinks;
+  }
+  if (PARALLEL) {
+    printf("Enter the number of partitions [1 to %d]:", MAXPARTS);
+    scanf("%d",&nparts);
+    printf("Enter the number of threads to run them on [1 to partitions]:");
+    scanf("%d",&nthreads);
+  }
+  if (AUTOSTOP) {
+    printf("Enter the relative precision at which to stop [e.g. 0.05]:");
+    scanf("%f",&precision);
+    printf("Enter the number of deliveries per mini-batch [e.g. 100]:");
+    scanf("%d",&batchsize);
+  }
+  if (REPLICAS) {
+    printf("Enter the number of replications [ >= 2]:");
+    scanf("%d",&nreplicas);
+    printf("Enter the number of worker processes to run them [1 to replications]:");
+    scanf("%d",&nworkers);
+  }
+  if (TUNE) {
+    printf("Enter the smallest and largest timeout to try [ > 0.0]:");
+    scanf("%f %f",&tunelo,&tunehi);
+    printf("Enter the number of runs of each configuration in the first round [ >= 2]:");
+    scanf("%d",&tunereps);
+  }
+  if (ARRIVALS == ONOFF) {
+    printf("Enter the mean length of an on period [ > 0.0]:");
+    scanf("%f",&onmean);
+    printf("Enter the mean length of an off period [ > 0.0]:");
+    scanf("%f",&offmean);
+  }
+  if (ARRIVALS == TRACEFILE) {
+    printf("Enter the name of the arrival trace file:");
+    scanf("%255s",tracename);
+  }
   printf("Enter TRACE:");
   scanf("%d",&TRACE);
 
+  bnservice = units2ticks(service);
+  if (nflows < 1 || (bnqueue > 0 && bnservice <= 0)) {
+    printf("Invalid flow or bottleneck settings.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (AUTOSTOP && (precision <= 0.0 || batchsize < 1)) {
+    printf("Invalid precision or batch size.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (REPLICAS && (nreplicas < 2 || nworkers < 1 || nworkers > nreplicas)) {
+    printf("Invalid number of replications or workers.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (TUNE && (tunelo <= 0.0 || tunehi < tunelo || tunereps < 2)) {
+    printf("Invalid timeouts or number of runs.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (nparts < 1 || nparts > MAXPARTS || nthreads < 1 || nthreads > nparts) {
+    printf("Invalid number of partitions or threads.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ARRIVALS == ONOFF && (onmean <= 0.0 || offmean <= 0.0)) {
+    printf("Invalid on or off period.\n");
+    exit(EXIT_FAILURE);
+  }
+#if ARRIVALS == TRACEFILE
+  opentrace();
+#endif
+}
+
+/* free what the flows of the last run held.  A run ends with no events
+   pending and no timers running, so nothing else refers to it */
+static void freeflows(void)
+{
+  int i;
+
+  for (i = 0; i < nflows; i++) {
+    free(flows[i].idtimer[A]);
+    free(flows[i].idtimer[B]);
+    free(flows[i].gentime);
+    free(flows[i].sent);
+    free(flows[i].arrival);
+    free(flows[i].verify);
+    free(flows[i].relayq);
+  }
+  free(flows);
+  flows = NULL;
+}
+
+/* set up a run with the given random number seed.  The partitions' event
+   lists and spare timers start out empty and are kept from run to run */
+static void startrun(unsigned int seed)
+{
+  float sum, avg;
+  int i, j;
+
+  if (flows != NULL)
+    freeflows();
+  for (i = 0; i < nparts; i++) {
+    parts[i].id = i;
+    parts[i].evcount = 0;
+    parts[i].evseq = 0;
+    tw_init(&parts[i].wheel, 0);
+    parts[i].time = 0;
+    parts[i].rng = seedstream(seed, i);
+  }
+  part = &parts[0];
+  for (i = 0; i < nlinks && RELAYS; i++) {
+    links[i].lastarrival[A] = links[i].lastarrival[B] = 0;
+    links[i].nsent = links[i].nlost = links[i].ncorrupt = 0;
+  }
 
-  srand(9999);              /* init random number generator */
+  srand(seed);              /* init random number generator */
   sum = 0.0;                /* test random number generator for students */
   for (i=0; i<1000; i++)
     sum+=jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -215,104 +976,446 @@ void init(void)                         /* initialize the simulator */
   packets_resent = 0;
   new_ACKs = 0;
   packets_received = 0;
-  packets_lost = 0;  
-  packets_corrupt = 0;
-  packets_sent = 0;
-  packets_timeout = 0;
+  packets_recovered = 0;
+  packets_refused = 0;
+  buffer_peak = 0;
   messages_delivered = 0;
+  nsim = 0;
 
   ntolayer3 = 0;
   nlost = 0;
   ncorrupt = 0;
+  bndropped = 0;
+  nspurious = 0;
+  lh_init(&lathist);
+  lh_init(&rechist);
+  prof.wallstart = prof.lastprogress = wallclock();
+  stopnow = 0;
+  if (AUTOSTOP)
+    bm_init(&bm, batchsize);
 
-  time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+  flows = calloc(nflows, sizeof(struct flow));
+  if (flows == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+  if (PROFILE)
+    allocated(nflows * sizeof(struct flow));
+
+  for (i = 0; i < nflows && nparts == 1; i++) {
+    flows[i].sent = calloc(SENTSLOTS, sizeof(struct sent));
+    if (flows[i].sent == 0) {
+      printf("memory allocation for flows failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (PROFILE)
+      allocated(SENTSLOTS * sizeof(struct sent));
+    for (j = 0; j < SENTSLOTS; j++)
+      flows[i].sent[j].pkt.seqnum = -1;
+  }
+
+  now=0;                       /* initialize time to 0 */
+  bnfree = 0;
+  nwindows = 0;
+  ncrossed = 0;
+  for (i = 0; i < nflows && VERIFY; i++) {
+    flows[i].verify = calloc(1, sizeof(struct verifier));
+    if (flows[i].verify == 0) {
+      printf("memory allocation for flows failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  tracenext = 0;
+  for (i = 0; i < nflows; i++) {
+    part = &parts[partof(i, A)];
+    if (ARRIVALS == ONOFF)
+      flows[i].onend = units2ticks(expdraw(onmean));
+    if ((ARRIVALS != TRACEFILE && !hopbyhop) || i == 0)
+      generate_next_arrival(i);  /* initialize event list */
+  }
+  part = &parts[0];
 }
 
 /********************** Student-callable ROUTINES ***********************/
 
+/* where the timer of the current flow's entity AorB with the given id is
+   kept; id -1 is the starttimer() timer */
+static struct twtimer **timerslot(int AorB, int id)
+{
+  struct flow *f = &flows[curflow];
+  int i, n;
+
+  if (id < 0)
+    return (&f->timer[AorB]);
+  if (id >= f->nidtimer[AorB]) {
+    n = f->nidtimer[AorB] ? f->nidtimer[AorB] : 8;
+    while (n <= id)
+      n *= 2;
+    f->idtimer[AorB] = realloc(f->idtimer[AorB], n * sizeof(struct twtimer *));
+    if (f->idtimer[AorB] == 0) {
+      printf("memory allocation for timers failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (PROFILE)
+      allocated(n * sizeof(struct twtimer *));
+    for (i = f->nidtimer[AorB]; i < n; i++)
+      f->idtimer[AorB][i] = NULL;
+    f->nidtimer[AorB] = n;
+  }
+  return (&f->idtimer[AorB][id]);
+}
+
+static void armtimer(int AorB, int id, double increment)
+{
+  struct twtimer **slot = timerslot(AorB, id);
+  struct twtimer *t;
+  int i;
+
+  /* be nice: check to see if timer is already started, if so, then  warn */
+  if (*slot != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+
+  if (part->twfree == NULL) {  /* get timers in blocks, they are recycled */
+    t = malloc(1024 * sizeof(struct twtimer));
+    if (t == 0) {
+      printf("memory allocation for timers failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (PROFILE)
+      allocated(1024 * sizeof(struct twtimer));
+    for (i = 0; i < 1023; i++)
+      t[i].next = &t[i+1];
+    t[1023].next = NULL;
+    part->twfree = t;
+  }
+  t = part->twfree;
+  part->twfree = t->next;
+
+  t->flow = curflow;
+  t->entity = AorB;
+  t->id = id;
+  *slot = t;
+  tw_add(&part->wheel, t, now + units2ticks(increment));
+  if (PROFILE)
+    prof.armed++;
+}
+
+static void disarmtimer(int AorB, int id)
+{
+  struct twtimer **slot = timerslot(AorB, id);
+
+  if (*slot == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  tw_cancel(&part->wheel, *slot);
+  if (PROFILE)
+    prof.disarmed++;
+  (*slot)->next = part->twfree;
+  part->twfree = *slot;
+  *slot = NULL;
+}
+
 /* called by students routine to cancel a previously-started timer */
 void stoptimer(int AorB)
 /* A or B is trying to stop timer */
 {
-  struct event *q;
-
   if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    printf("          STOP TIMER: stopping timer at %f\n",ticks2units(now));
+  disarmtimer(AorB, -1);
 }
 
 
 void starttimer(int AorB, double increment)
 /* A or B is trying to start timer */
 {
+  if (TRACE>1)
+    printf("          START TIMER: starting timer at %f\n",ticks2units(now));
+  armtimer(AorB, -1, increment);
+} 
 
-  struct event *q;
-  struct event *evptr;
+/* timers named by id: any number may run at each entity at once */
+void stoptimer_id(int AorB, int id)
+{
+  if (TRACE>1)
+    printf("          STOP TIMER: stopping timer %d at %f\n",id,ticks2units(now));
+  disarmtimer(AorB, id);
+}
 
+void starttimer_id(int AorB, int id, double increment)
+{
   if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
-  /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
+    printf("          START TIMER: starting timer %d at %f\n",id,ticks2units(now));
+  if (id < 0) {
+    printf("Warning: timer ids must not be negative\n");
+    return;
+  }
+  armtimer(AorB, id, increment);
+}
+
+/* a timer has gone off: release it, then call the entity's handler */
+static void timerinterrupt(struct twtimer *t)
+{
+  int AorB = t->entity, id = t->id;
+
+  now = t->expiry;
+  curflow = t->flow;
+  if (TRACE>=2) {
+    printf("\nEVENT time: %f,",ticks2units(now));
+    printf("  type: %d",TIMER_INTERRUPT);
+    printf(", timerinterrupt  ");
+    printf(" entity: %d\n",AorB);
+  }
+  *timerslot(AorB, id) = NULL;
+  t->next = part->twfree;
+  part->twfree = t;
+
+  if (id < 0) {
+    if (AorB == A)
+      A_timerinterrupt();
+    else
+      B_timerinterrupt();
+  }
+  else {
+    if (AorB == A)
+      A_timerinterrupt_id(id);
+    else
+      B_timerinterrupt_id(id);
+  }
+}
+
+
+/* time at which a packet sent into the bottleneck now has been served, or
+   a negative time if the queue is full and the packet is dropped */
+static simtime_t bottleneck(void)
+{
+  simtime_t queued = 0;
+
+  if (bnfree > now)
+    queued = (bnfree - now + bnservice - 1) / bnservice;
+  if (queued >= bnqueue)
+    return (-1);
+  if (bnfree < now)
+    bnfree = now;
+  bnfree += bnservice;
+  return (bnfree);
+}
+
+/* remember when an accepted message was generated, until it is delivered */
+static void pushgentime(struct flow *f, simtime_t t)
+{
+  int i;
+  simtime_t *grown;
+
+  if (f->gcount == f->gsize) {
+    grown = malloc((f->gsize ? 2 * f->gsize : 8) * sizeof(simtime_t));
+    if (grown == 0) {
+      printf("memory allocation for generation times failed.");
+      exit(EXIT_FAILURE);
     }
- 
-  /* create future event for when timer goes off */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
+    if (PROFILE)
+      allocated((f->gsize ? 2 * f->gsize : 8) * sizeof(simtime_t));
+    for (i = 0; i < f->gcount; i++)
+      grown[i] = f->gentime[(f->ghead + i) % f->gsize];
+    free(f->gentime);
+    f->gentime = grown;
+    f->ghead = 0;
+    f->gsize = f->gsize ? 2 * f->gsize : 8;
   }
-  evptr->evtime =  time + increment;
-  evptr->evtype =  TIMER_INTERRUPT;
-   
- 
-  evptr->eventity = AorB;
-  insertevent(evptr);
-} 
+  f->gentime[(f->ghead + f->gcount) % f->gsize] = t;
+  f->gcount++;
+}
 
+/* generation time of the oldest undelivered message, or -1 if none.
+   Messages are delivered in the order they were accepted */
+static simtime_t popgentime(struct flow *f)
+{
+  simtime_t t;
 
-/************************** TOLAYER3 ***************/
-void tolayer3(int AorB, struct pkt packet)
-/* A or B is sending to network  */
+  if (f->gcount == 0)
+    return (-1);
+  t = f->gentime[f->ghead];
+  f->ghead = (f->ghead + 1) % f->gsize;
+  f->gcount--;
+  return (t);
+}
+
+/* is p the packet q, resent? */
+static int samepacket(struct pkt *p, struct pkt *q)
+{
+  int i;
+
+  if (p->seqnum != q->seqnum || p->acknum != q->acknum)
+    return 0;
+  for (i=0; i<MAXPAYLOAD; i++)
+    if (p->payload[i] != q->payload[i])
+      return 0;
+  return 1;
+}
+
+/* A is sending packet p.  Returns 1 if it is a spurious resend: an
+   undamaged copy sent earlier is on its way to B or has been ACKed */
+static int spurious(struct flow *f, struct pkt *p)
+{
+  struct sent *s = &f->sent[p->seqnum % SENTSLOTS];
+
+  if (samepacket(p, &s->pkt))
+    return (s->held || s->inflight > 0);
+  s->pkt = *p;
+  s->inflight = 0;
+  s->held = 0;
+  s->losttime = -1;
+  return 0;
+}
+
+/* a copy of packet p sent by A has been lost or damaged */
+static void damaged(struct flow *f, struct pkt *p)
+{
+  struct sent *s = &f->sent[p->seqnum % SENTSLOTS];
+
+  if (nparts == 1 && p->seqnum >= 0 && !s->held && s->losttime < 0 &&
+      samepacket(p, &s->pkt))
+    s->losttime = now;
+}
+
+/* an undamaged copy of packet p has reached B, or a relay has lost or
+   damaged it on a later link, so it is no longer on its way */
+static void landed(struct flow *f, struct pkt *p)
+{
+  struct sent *s = &f->sent[p->seqnum % SENTSLOTS];
+
+  if (p->seqnum >= 0 && s->inflight > 0 && samepacket(p, &s->pkt))
+    s->inflight--;
+}
+
+/* a newly accepted message may have the contents of an old one: forget
+   the old packets, so that the new one's first send is not a resend.  A
+   packet of several messages may hold it anywhere in its payload */
+static void forgetsent(struct flow *f, struct msg *m)
+{
+  int i, j, k;
+
+  for (i = 0; i < SENTSLOTS; i++)
+    for (k = 0; k + 20 <= MAXPAYLOAD; k++) {
+      for (j=0; j<20 && f->sent[i].pkt.payload[k+j] == m->data[j]; j++)
+        ;
+      if (j == 20) {
+        f->sent[i].pkt.seqnum = -1;
+        f->sent[i].inflight = 0;
+        f->sent[i].held = 0;
+        f->sent[i].losttime = -1;
+        break;
+      }
+    }
+}
+
+/* a relay's queue of messages for the next link's A (RELAYS on every link) */
+static void relaypush(struct flow *f, char data[20])
 {
+  int i;
+  struct msg *grown;
+
+  if (f->rcount == f->rsize) {
+    grown = malloc((f->rsize ? 2 * f->rsize : 8) * sizeof(struct msg));
+    if (grown == 0) {
+      printf("memory allocation for relay queue failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (PROFILE)
+      allocated((f->rsize ? 2 * f->rsize : 8) * sizeof(struct msg));
+    for (i = 0; i < f->rcount; i++)
+      grown[i] = f->relayq[(f->rhead + i) % f->rsize];
+    free(f->relayq);
+    f->relayq = grown;
+    f->rhead = 0;
+    f->rsize = f->rsize ? 2 * f->rsize : 8;
+  }
+  for (i = 0; i < 20; i++)
+    f->relayq[(f->rhead + f->rcount) % f->rsize].data[i] = data[i];
+  f->rcount++;
+  if (f->rcount > f->rpeak)
+    f->rpeak = f->rcount;
+}
+
+/* offer each relay's waiting messages to its link's A, oldest first, until
+   it refuses one.  A refusal is not a drop here: the message waits, and
+   is not counted as dropped for a full window */
+static void drainrelays(void)
+{
+  struct flow *f;
+  long long refused;
+  int i, saved = curflow;
+
+  for (i = 1; i < nflows; i++) {
+    f = &flows[i];
+    curflow = i;
+    while (f->rcount > 0) {
+      refused = window_full;
+      A_output(f->relayq[f->rhead]);
+      if (window_full != refused) {
+        window_full = refused;
+        break;
+      }
+      forgetsent(f, &f->relayq[f->rhead]);
+      f->rhead = (f->rhead + 1) % f->rsize;
+      f->rcount--;
+    }
+  }
+  curflow = saved;
+}
+
+/* carry a packet from A's or B's side of a link towards the other side:
+   lose it, corrupt it or schedule its arrival.  Without RELAYS there is
+   just link 0, with the probabilities entered at the start */
+static void cross(int AorB, struct pkt packet, int link)
+{
+  struct flow *f = &flows[curflow];
   struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
+  struct event *evptr;
+  simtime_t lastime;
+  simtime_t *lastarrival;
+  float x;
   int i;
 
-  ntolayer3++;
+  /* a packet passed on by a relay was counted on the way to B by the
+     first link */
+  int relayed = RELAYS && !hopbyhop && link != (AorB == A ? 0 : nlinks - 1);
+
+  if (RELAYS)
+    links[link].nsent++;
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if (jimsrand() < (RELAYS ? links[link].lossprob : lossprob) && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
     nlost++;
+    f->nlost[AorB]++;
+    if (RELAYS)
+      links[link].nlost++;
+    if (AorB == A)
+      damaged(f, &packet);
+    if (nparts == 1 && AorB == A && relayed)
+      landed(f, &packet);
     if (TRACE>0)    
       printf("          TOLAYER3: packet being lost\n");
     return;
   }  
 
+  /* packets from A to B queue at the shared bottleneck */
+  lastime = now;
+  if (AorB == A && bnqueue > 0) {
+    lastime = bottleneck();
+    if (lastime < 0) {
+      bndropped++;
+      f->ndropped++;
+      damaged(f, &packet);
+      if (TRACE>0)
+        printf("          TOLAYER3: packet dropped at full bottleneck queue\n");
+      return;
+    }
+  }
+
   /* make a copy of the packet student just gave me since he/she may decide */
   /* to do something with the packet after we return back to him/her */ 
   mypktptr = malloc(sizeof(struct pkt));
@@ -320,15 +1423,17 @@ void tolayer3(int AorB, struct pkt packet)
     printf("memory allocation for event failed.");
     exit(EXIT_FAILURE);
   }
+  if (PROFILE)
+    allocated(sizeof(struct pkt));
   mypktptr->seqnum = packet.seqnum;
   mypktptr->acknum = packet.acknum;
   mypktptr->checksum = packet.checksum;
-  for (i=0; i<20; i++)
+  for (i=0; i<MAXPAYLOAD; i++)
     mypktptr->payload[i] = packet.payload[i];
   if (TRACE>2)  {
     printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
            mypktptr->acknum,  mypktptr->checksum);
-    for (i=0; i<20; i++)
+    for (i=0; i<MAXPAYLOAD; i++)
       printf("%c",mypktptr->payload[i]);
     printf("\n");
   }
@@ -339,42 +1444,145 @@ void tolayer3(int AorB, struct pkt packet)
     printf("memory allocation for event failed.");
     exit(EXIT_FAILURE);
   }
+  if (PROFILE)
+    allocated(sizeof(struct event));
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
   evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
+  evptr->evflow = curflow;
+  evptr->evhop = link;
   evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
      currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+  lastarrival = RELAYS ? links[link].lastarrival : f->lastarrival;
+  if (lastarrival[evptr->eventity] > lastime)
+    lastime = lastarrival[evptr->eventity];
+  evptr->evtime =  lastime + units2ticks(1 + (RELAYS ? links[link].maxdelay - 1 : 9)*jimsrand());
+  lastarrival[evptr->eventity] = evptr->evtime;
  
 
 
   /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if ((jimsrand() < (RELAYS ? links[link].corruptprob : corruptprob))  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
     ncorrupt++;
+    if (RELAYS)
+      links[link].ncorrupt++;
     if ( (x = jimsrand()) < .75)
       mypktptr->payload[0]='Z';   /* corrupt payload */
     else if (x < .875)
       mypktptr->seqnum = 999999;
     else
       mypktptr->acknum = 999999;
+    if (AorB == A)
+      damaged(f, &packet);
+    if (nparts == 1 && AorB == A && relayed)
+      landed(f, &packet);
     if (TRACE>0)    
       printf("          TOLAYER3: packet being corrupted\n");
   }  
 
+  /* an undamaged data packet is on its way */
+  if (nparts == 1 && AorB == A && !relayed && mypktptr->seqnum >= 0 &&
+      samepacket(mypktptr, &f->sent[mypktptr->seqnum % SENTSLOTS].pkt))
+    f->sent[mypktptr->seqnum % SENTSLOTS].inflight++;
+
   if (TRACE>2)  
     printf("          TOLAYER3: scheduling arrival on other side\n");
   insertevent(evptr);
 } 
 
+/************************** TOLAYER3 ***************/
+void tolayer3(int AorB, struct pkt packet)
+/* A or B is sending to network  */
+{
+  struct flow *f = &flows[curflow];
+
+  ntolayer3++;
+  f->ntolayer3[AorB]++;
+
+  /* B has a data packet once it answers it with an ACK of the same
+     sequence number */
+  if (nparts == 1 && AorB == A && packet.seqnum >= 0 && spurious(f, &packet))
+    nspurious++;
+  if (nparts == 1 && AorB == B && arriving != NULL && arriving->seqnum >= 0 &&
+      packet.acknum == arriving->seqnum &&
+      samepacket(arriving, &f->sent[arriving->seqnum % SENTSLOTS].pkt)) {
+    struct sent *s = &f->sent[arriving->seqnum % SENTSLOTS];
+
+    s->held = 1;
+    if (s->losttime >= 0) {
+      lh_add(&rechist, now - s->losttime);
+      s->losttime = -1;
+    }
+  }
+
+  if (!RELAYS)
+    cross(AorB, packet, 0);
+  else if (hopbyhop)
+    cross(AorB, packet, curflow);
+  else
+    cross(AorB, packet, AorB == A ? 0 : nlinks - 1);
+} 
+
+
+/* delivery checking (VERIFY) */
+static void violation(struct verifier *v, const char *kind, long long got)
+{
+  if (v->violations++ == 0) {
+    v->firsttime = now;
+    v->firstkind = kind;
+    v->firstgot = got;
+    v->firstwanted = v->next;
+  }
+}
+
+/* a message has reached layer 5: it must be the next one of its flow, and
+   must not have come before.  A gap is reported once, when the message
+   after it arrives; the numbers skipped count as missing until they do */
+static void verify(struct verifier *v, char data[20])
+{
+  long long n = 0;
+  long long m;
+  int i;
+
+  for (i=20-VDIGITS; i<20; i++) {
+    if (data[i] < '0' || data[i] > '9') {
+      violation(v, "garbled", -1);
+      return;
+    }
+    n = 10 * n + (data[i] - '0');
+  }
+  if (n < v->next - VBITS) {   /* too old to remember */
+    violation(v, "late or repeated", n);
+    v->unchecked++;
+    return;
+  }
+  if (n < v->next) {
+    if (v->seen[n % VBITS / 64] >> (n % 64) & 1)
+      violation(v, "duplicate", n);
+    else {
+      violation(v, "late", n);
+      v->seen[n % VBITS / 64] |= 1ULL << (n % 64);
+      v->missing--;
+    }
+    return;
+  }
+  if (n > v->next) {
+    violation(v, "out of order", n);
+    v->missing += n - v->next;
+  }
+
+  /* the numbers skipped take the place of ones VBITS older */
+  for (m = n - v->next > VBITS ? n - VBITS : v->next; m < n; m++)
+    v->seen[m % VBITS / 64] &= ~(1ULL << (m % 64));
+  v->seen[n % VBITS / 64] |= 1ULL << (n % 64);
+  v->next = n + 1;
+}
+
 void tolayer5(int AorB, char datasent[20])
 {
+  simtime_t gentime;
   int i;  
   if (TRACE>2) {
     printf("          TOLAYER5: data received by application at ");
@@ -386,93 +1594,704 @@ void tolayer5(int AorB, char datasent[20])
       printf("%c",datasent[i]);
     printf("\n");
   }
+
+  /* on every link, a relay's B hands the message on; it was accepted by
+     flow 0, and reaches layer 5 at the last link's B */
+  if (RELAYS && hopbyhop && curflow < nlinks - 1) {
+    relaypush(&flows[curflow + 1], datasent);
+    return;
+  }
   messages_delivered++;
+  flows[curflow].delivered++;
+  if (VERIFY)
+    verify(flows[hopbyhop ? 0 : curflow].verify, datasent);
+
+  if (nparts == 1) {
+    gentime = popgentime(&flows[hopbyhop ? 0 : curflow]);
+    if (gentime >= 0) {
+      lh_add(&lathist, now - gentime);
+      if (AUTOSTOP && bm_add(&bm, ticks2units(now), ticks2units(now - gentime)))
+        stopnow = bm_converged(&bm, precision);
+    }
+  }
 }
 
-int main(void)
+/* outcome of the delivery check over all flows */
+static void printverify(void)
+{
+  struct verifier *v, *first = NULL;
+  long long violations = 0, undelivered = 0, unchecked = 0;
+  int i, firstflow = 0;
+
+  for (i = 0; i < nflows; i++) {
+    v = flows[i].verify;
+    violations += v->violations;
+    undelivered += flows[i].accepted - v->next + v->missing;
+    unchecked += v->unchecked;
+    if (v->violations > 0 && (first == NULL || v->firsttime < first->firsttime)) {
+      first = v;
+      firstflow = i;
+    }
+  }
+  printf("\ndelivery check:  %lld violations, %lld accepted messages not delivered \n",
+         violations, undelivered);
+  if (unchecked > 0)
+    printf("%lld deliveries too old to tell late from repeated \n", unchecked);
+  if (first == NULL)
+    printf("every delivered message arrived once and in order \n");
+  else
+    printf("first violation at time %f, flow %d: %s, message %lld delivered, expected %lld \n",
+           ticks2units(first->firsttime), firstflow, first->firstkind, first->firstgot,
+           first->firstwanted);
+}
+
+/* per-flow and aggregate statistics of a multi-flow run */
+static void printflows(void)
+{
+  struct flow *f;
+  double sum = 0.0, sumsq = 0.0;
+  long long min = 0, max = 0;
+  int i;
+
+  printf("\n flow     msgs  delivered  tolayer3   lost  qdropped\n");
+  for (i = 0; i < nflows; i++) {
+    f = &flows[i];
+    printf("%5d %8lld %10lld %9lld %6lld %9lld\n", i, f->nsim, f->delivered,
+           f->ntolayer3[A] + f->ntolayer3[B], f->nlost[A] + f->nlost[B], f->ndropped);
+    sum += f->delivered;
+    sumsq += (double)f->delivered * f->delivered;
+    if (i == 0 || f->delivered < min)
+      min = f->delivered;
+    if (i == 0 || f->delivered > max)
+      max = f->delivered;
+  }
+  printf("number of flows:  %d \n", nflows);
+  printf("number of packets sent into layer 3:  %lld \n", ntolayer3);
+  printf("number of packets lost in the medium:  %lld \n", nlost);
+  printf("number of packets dropped at the bottleneck queue:  %lld \n", bndropped);
+  printf("messages delivered per flow: min %lld, mean %.2f, max %lld \n", min, sum / nflows, max);
+  printf("Jain's fairness index of delivered messages:  %.4f \n",
+         sumsq > 0.0 ? sum * sum / (nflows * sumsq) : 1.0);
+  printf("aggregate goodput (messages delivered per time unit):  %f \n",
+         now > 0 ? messages_delivered / ticks2units(now) : 0.0);
+}
+
+/* what each link of a relay path carried (RELAYS) */
+static void printlinks(void)
+{
+  struct link *l;
+  long long sent = 0;
+  int i, peak = 0;
+
+  printf("\n link   loss  corrupt  delay      sent     lost  corrupted\n");
+  for (i = 0; i < nlinks; i++) {
+    l = &links[i];
+    printf("%5d %6.3f %8.3f %6.1f %9lld %8lld %10lld\n", i, l->lossprob, l->corruptprob,
+           l->maxdelay, l->nsent, l->nlost, l->ncorrupt);
+    sent += l->nsent;
+  }
+  for (i = 0; i < nflows; i++)
+    if (flows[i].rpeak > peak)
+      peak = flows[i].rpeak;
+  printf("ARQ:  %s \n", hopbyhop ? "on every link" : "end to end");
+  printf("number of link transmissions:  %lld \n", sent);
+  if (hopbyhop)
+    printf("most messages waiting at a relay:  %d \n", peak);
+  printf("goodput (messages delivered per time unit):  %f \n",
+         now > 0 ? messages_delivered / ticks2units(now) : 0.0);
+}
+
+/* a line on stderr every second of wall-clock time, so long runs show
+   how far they have got (PROFILE) */
+static void progress(void)
+{
+  double wall = wallclock();
+  long long events = prof.events[0] + prof.events[1] + prof.events[2];
+
+  if (wall - prof.lastprogress < 1.0)
+    return;
+  prof.lastprogress = wall;
+  fprintf(stderr, "progress: time %.1f, messages %lld, delivered %lld, %.0f events per second\n",
+          ticks2units(now), nsim, messages_delivered, events / (wall - prof.wallstart));
+}
+
+static void printprofile(void)
+{
+  long long events = prof.events[0] + prof.events[1] + prof.events[2];
+  double wall = wallclock() - prof.wallstart;
+#if PROFILE
+  struct rusage usage;
+#endif
+
+  printf("\nevents simulated:  %lld (timer %lld, from layer 5 %lld, from layer 3 %lld) \n", events,
+         prof.events[TIMER_INTERRUPT], prof.events[FROM_LAYER5], prof.events[FROM_LAYER3]);
+  printf("event list length:  mean %.2f, max %d \n",
+         events > 0 ? (double)prof.evlistsum / events : 0.0, prof.evlistmax);
+  printf("heap nodes moved past while sifting:  %lld (%.2f per event) \n", prof.visited,
+         events > 0 ? (double)prof.visited / events : 0.0);
+  printf("timers started:  %lld, stopped:  %lld \n", prof.armed, prof.disarmed);
+  printf("blocks allocated:  %lld (%lld bytes) \n", prof.allocs, prof.allocbytes);
+#if PROFILE
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    printf("peak resident memory:  %ld kB \n", usage.ru_maxrss);
+#endif
+  printf("wall-clock time:  %.3f s, %.0f events per second \n", wall, wall > 0 ? events / wall : 0.0);
+}
+
+/* may the current flow generate another message?  With several
+   partitions every flow has a fixed share of nsimmax, so that the count
+   does not depend on how the partitions interleave */
+static int moremessages(void)
+{
+  if (nparts > 1)
+    return (flows[curflow].nsim < nsimmax / nflows + (curflow < nsimmax % nflows));
+  return (nsim < nsimmax);
+}
+
+/* simulate the next event of the current partition if it is due before
+   limit.  Returns 0 if there is none */
+static int step(simtime_t limit)
 {
   struct event *eventptr;
+  struct twtimer *timerptr;
   struct msg  msg2give;
   struct pkt  pkt2give;
+  simtime_t due;
    
-  int i,j;
-  
-  init();
-  A_init();
-  B_init();
-   
-  while (1) {
-    eventptr = evlist;            /* get next event to simulate */
-    if (eventptr==NULL)
-      goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
-      printf("\nEVENT time: %f,",eventptr->evtime);
-      printf("  type: %d",eventptr->evtype);
-      if (eventptr->evtype==0)
-        printf(", timerinterrupt  ");
-      else if (eventptr->evtype==1)
-        printf(", fromlayer5 ");
-      else
-        printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
-    }
-    time = eventptr->evtime;        /* update time to next event time */
-    if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
-        /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
-        for (i=0; i<20; i++)  
-          msg2give.data[i] = 97 + j;
-        if (TRACE>2) {
-          printf("          MAINLOOP: data given to student: ");
-          for (i=0; i<20; i++) 
-            printf("%c", msg2give.data[i]);
-          printf("\n");
-        }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
-        else
-          B_output(msg2give);  
+  int i,entity,refused;
+
+  /* timers due no later than the next event go first */
+  due = part->evcount > 0 ? part->evlist[0]->evtime : TW_NEVER;
+  if (due > limit - 1)
+    due = limit - 1;
+  timerptr = tw_pop(&part->wheel, due);
+  if (PROFILE && (timerptr != NULL || (part->evcount > 0 && part->evlist[0]->evtime < limit))) {
+    prof.events[timerptr != NULL ? TIMER_INTERRUPT : part->evlist[0]->evtype]++;
+    prof.evlistsum += part->evcount;
+    if (part->evcount > prof.evlistmax)
+      prof.evlistmax = part->evcount;
+    if (((prof.events[0] + prof.events[1] + prof.events[2]) & 0xffff) == 0)
+      progress();
+  }
+  if (timerptr != NULL) {
+    timerinterrupt(timerptr);
+    if (RELAYS && hopbyhop)
+      drainrelays();
+    return 1;
+  }
+  if (part->evcount == 0 || part->evlist[0]->evtime >= limit)
+    return 0;
+
+  eventptr = part->evlist[0];   /* get next event to simulate */
+  removeevent(eventptr);        /* remove this event from event list */
+  if (TRACE>=2) {
+    printf("\nEVENT time: %f,",ticks2units(eventptr->evtime));
+    printf("  type: %d",eventptr->evtype);
+    if (eventptr->evtype==0)
+      printf(", timerinterrupt  ");
+    else if (eventptr->evtype==1)
+      printf(", fromlayer5 ");
+    else
+      printf(", fromlayer3 ");
+    printf(" entity: %d\n",eventptr->eventity);
+  }
+  now = eventptr->evtime;        /* update time to next event time */
+  curflow = eventptr->evflow;
+  if (eventptr->evtype == FROM_LAYER5 ) {
+    if (moremessages()) {
+      /* fill in msg to give with string of same letter */    
+      makemessage(&msg2give);
+      entity = eventptr->eventity;
+      generate_next_arrival(curflow);   /* set up future arrival */
+      if (TRACE>2) {
+        printf("          MAINLOOP: data given to student: ");
+        for (i=0; i<20; i++) 
+          printf("%c", msg2give.data[i]);
+        printf("\n");
       }
-      else if (TRACE > 2)
-          printf("          FROM_LAYER5: no more messages to send: \n");
-    }
-    else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
-      else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
-    }
-    else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
+      nsim++;
+      flows[curflow].nsim++;
+      refused = window_full;
+      if (entity == A) 
+        A_output(msg2give);  
       else
-        B_timerinterrupt();
+        B_output(msg2give);  
+      if (VERIFY && window_full == refused)
+        flows[curflow].accepted++;
+      if (nparts == 1 && window_full == refused) {
+        pushgentime(&flows[curflow], now);
+        forgetsent(&flows[curflow], &msg2give);
+      }
     }
-    else  {
-      printf("INTERNAL PANIC: unknown event type \n");
+    else if (TRACE > 2)
+        printf("          FROM_LAYER5: no more messages to send: \n");
+  }
+  else if (eventptr->evtype ==  FROM_LAYER3) {
+    pkt2give.seqnum = eventptr->pktptr->seqnum;
+    pkt2give.acknum = eventptr->pktptr->acknum;
+    pkt2give.checksum = eventptr->pktptr->checksum;
+    for (i=0; i<MAXPAYLOAD; i++)  
+      pkt2give.payload[i] = eventptr->pktptr->payload[i];
+    /* end to end, a relay passes the packet on over the next link */
+    if (RELAYS && !hopbyhop && eventptr->evhop != (eventptr->eventity == B ? nlinks - 1 : 0))
+      cross((eventptr->eventity + 1) % 2, pkt2give,
+            eventptr->evhop + (eventptr->eventity == B ? 1 : -1));
+    else if (eventptr->eventity ==A)      /* deliver packet by calling */
+      A_input(pkt2give);            /* appropriate entity */
+    else {
+      arriving = eventptr->pktptr;
+      if (nparts == 1)
+        landed(&flows[curflow], arriving);
+      B_input(pkt2give);
+      arriving = NULL;
     }
+    free(eventptr->pktptr);          /* free the memory for packet */
+  }
+  else  {
+    printf("INTERNAL PANIC: unknown event type \n");
+  }
+  if (eventptr->evtype != FROM_LAYER5)  /* arrival events are kept */
     free(eventptr);
+  if (RELAYS && hopbyhop)
+    drainrelays();
+  return 1;
+}
+
+/* run the scenario once with the protocol's window and timeout set, on
+   the seed of replication rep.  Returns the measure being tuned, larger
+   being better: goodput, or p99 latency negated.  The p99 is over every
+   message layer 5 offered, those A refused or never delivered counting
+   as infinitely late, so that a window too small to carry the load
+   cannot win.  When more than 1% are missing the p99 is infinite, and
+   the run scores its length, which no latency exceeds, scaled up by the
+   fraction missing */
+static double tunerun(int window, double timeout, int rep)
+{
+  A_window = window;
+  A_timeout = timeout;
+  startrun(SEED + rep);
+  for (curflow = 0; curflow < nflows; curflow++) {
+    A_init();
+    B_init();
   }
+  while (step(TW_NEVER))
+    ;
+  ntuneruns++;
+  if (TUNE == 1)
+    return (now > 0 ? messages_delivered / ticks2units(now) : 0.0);
+  if (0.99 * nsim >= messages_delivered)
+    return (-ticks2units(now) * (2.0 - (double)messages_delivered / nsim));
+  return (-ticks2units(lh_quantile(&lathist, 0.99 * nsim / messages_delivered)));
+}
+
+/* a window and timeout, and what its runs so far scored */
+struct config {
+  int window;
+  double timeout;
+  struct replications score;
+};
+
+/* the better of two configurations first; ties go to the smaller window,
+   then the shorter timeout */
+static int bybest(const void *p, const void *q)
+{
+  const struct config *a = p, *b = q;
+  double ma = a->score.sum / a->score.n, mb = b->score.sum / b->score.n;
+
+  if (ma != mb)
+    return (ma > mb ? -1 : 1);
+  if (a->window != b->window)
+    return (a->window - b->window);
+  return (a->timeout < b->timeout ? -1 : a->timeout > b->timeout);
+}
+
+/* score a configuration on replications 0 to reps - 1, keeping the runs
+   it already has */
+static void score(struct config *c, int reps)
+{
+  while (c->score.n < reps)
+    rp_add(&c->score, tunerun(c->window, c->timeout, c->score.n));
+}
+
+static void printconfig(const char *what, struct config *c)
+{
+  printf("%s window %d, timeout %f:  %s %f +/- %f (95%%, %d runs) \n", what,
+         c->window, c->timeout, TUNE == 1 ? "goodput" : "p99 latency",
+         fabs(rp_mean(&c->score)), rp_halfwidth(&c->score), c->score.n);
+}
+
+/* find the best window, from 1 to A_window as built, and timeout, from
+   tunelo to tunehi */
+static void tune(void)
+{
+  struct config *c, built, lo, hi, x1, x2;
+  double ratio = pow(tunehi / tunelo, 1.0 / (TUNETIMEOUTS - 1));
+  double golden = (sqrt(5.0) - 1.0) / 2.0;
+  int nconfigs = A_window * TUNETIMEOUTS, alive = nconfigs, reps = tunereps, i;
+
+  c = malloc(nconfigs * sizeof(struct config));
+  if (c == NULL) {
+    printf("memory allocation for tuning failed.");
+    exit(EXIT_FAILURE);
+  }
+  built.window = A_window;
+  built.timeout = A_timeout;
+  rp_init(&built.score);
+  for (i = 0; i < nconfigs; i++) {
+    c[i].window = 1 + i / TUNETIMEOUTS;
+    c[i].timeout = tunelo * pow(ratio, i % TUNETIMEOUTS);
+    rp_init(&c[i].score);
+  }
+
+  /* successive halving: every round the better half goes on, with twice
+     the runs, until one is left; it gets a last round to itself */
+  printf("\n");
+  for (;;) {
+    for (i = 0; i < alive; i++)
+      score(&c[i], reps);
+    qsort(c, alive, sizeof(struct config), bybest);
+    printf("round of %d configurations, %d runs each: ", alive, reps);
+    printconfig("best", &c[0]);
+    if (alive == 1)
+      break;
+    alive = (alive + 1) / 2;
+    reps *= 2;
+  }
+
+  /* golden-section search for the timeout, between the winner's grid
+     neighbours, in log time, over the same runs */
+  lo = hi = x1 = x2 = c[0];
+  lo.timeout = c[0].timeout / ratio < tunelo ? tunelo : c[0].timeout / ratio;
+  hi.timeout = c[0].timeout * ratio > tunehi ? tunehi : c[0].timeout * ratio;
+  x1.timeout = exp(log(hi.timeout) - golden * log(hi.timeout / lo.timeout));
+  x2.timeout = exp(log(lo.timeout) + golden * log(hi.timeout / lo.timeout));
+  rp_init(&x1.score);
+  rp_init(&x2.score);
+  score(&x1, reps);
+  score(&x2, reps);
+  for (i = 0; i < TUNESTEPS; i++) {
+    if (bybest(&x1, &x2) < 0) {
+      hi = x2;
+      x2 = x1;
+      x1.timeout = exp(log(hi.timeout) - golden * log(hi.timeout / lo.timeout));
+      rp_init(&x1.score);
+      score(&x1, reps);
+    }
+    else {
+      lo = x1;
+      x1 = x2;
+      x2.timeout = exp(log(lo.timeout) + golden * log(hi.timeout / lo.timeout));
+      rp_init(&x2.score);
+      score(&x2, reps);
+    }
+  }
+  if (bybest(&x2, &x1) < 0)
+    x1 = x2;
+  if (bybest(&x1, &c[0]) < 0)
+    c[0] = x1;
+  score(&built, reps);
+
+  printf("\ntuned %s over %lld runs of %lld messages each \n",
+         TUNE == 1 ? "for goodput (messages delivered per time unit)" : "for p99 latency",
+         ntuneruns, nsimmax);
+  printconfig("as built:", &built);
+  printconfig("best:    ", &c[0]);
+  free(c);
+}
+
+#if REPLICAS
+/* make replication r, on seed SEED + r, and keep its measures */
+static void replicate(struct result *res, int r)
+{
+  startrun(SEED + r);
+  for (curflow = 0; curflow < nflows; curflow++) {
+    A_init();
+    B_init();
+  }
+  while (step(TW_NEVER))
+    ;
+  res[r].delivered = messages_delivered;
+  res[r].refused = window_full;
+  res[r].resent = packets_resent;
+  res[r].sent = ntolayer3;
+  res[r].endtime = ticks2units(now);
+  res[r].p99 = ticks2units(lh_quantile(&lathist, 0.99));
+}
 
- terminate:
-  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
-  printf("number of messages dropped due to full window:  %d \n", window_full);
-  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
+/* run all the replications on n worker processes, worker w taking
+   replications w, w + n, ...  Returns the wall-clock seconds taken */
+static double runpool(struct result *res, int n)
+{
+  pid_t *workers;
+  double start;
+  int w, r, status;
+
+  workers = malloc(n * sizeof(pid_t));
+  if (workers == NULL) {
+    printf("memory allocation for workers failed.");
+    exit(EXIT_FAILURE);
+  }
+  fflush(stdout);
+  start = wallclock();
+  for (w = 0; w < n; w++) {
+    workers[w] = fork();
+    if (workers[w] < 0) {
+      printf("cannot start worker %d.\n", w);
+      exit(EXIT_FAILURE);
+    }
+    if (workers[w] == 0) {
+      for (r = w; r < nreplicas; r += n)
+        replicate(res, r);
+      fflush(stdout);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+  for (w = 0; w < n; w++)
+    if (waitpid(workers[w], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) {
+      printf("worker %d did not finish.\n", w);
+      exit(EXIT_FAILURE);
+    }
+  free(workers);
+  return (wallclock() - start);
+}
+
+/* run the replications on nworkers processes and report them.  With more
+   than one worker the same runs are first made on one, one after another,
+   and timed, to give the rate the pool is compared with */
+static void replicas(void)
+{
+  struct result *res;
+  struct replications goodput, p99;
+  double elapsed, serial;
+  int r;
+
+  res = mmap(NULL, nreplicas * sizeof(struct result), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (res == MAP_FAILED) {
+    printf("memory allocation for replications failed.");
+    exit(EXIT_FAILURE);
+  }
+  serial = runpool(res, 1);
+  elapsed = (nworkers > 1 ? runpool(res, nworkers) : serial);
+
+  printf("\n repl   seed  delivered    refused    resends  tolayer3     end time         p99 \n");
+  rp_init(&goodput);
+  rp_init(&p99);
+  for (r = 0; r < nreplicas; r++) {
+    printf("%5d %6d %10lld %10lld %10lld %9lld %12.3f %11.3f \n", r, SEED + r,
+           res[r].delivered, res[r].refused, res[r].resent, res[r].sent,
+           res[r].endtime, res[r].p99);
+    rp_add(&goodput, res[r].endtime > 0.0 ? res[r].delivered / res[r].endtime : 0.0);
+    rp_add(&p99, res[r].p99);
+  }
+  printf("goodput (messages delivered per time unit):  %f +/- %f (95%%, %d replications) \n",
+         rp_mean(&goodput), rp_halfwidth(&goodput), nreplicas);
+  printf("p99 latency:  %f +/- %f (95%%, %d replications) \n",
+         rp_mean(&p99), rp_halfwidth(&p99), nreplicas);
+  printf("replications per second:  %.1f on %d workers, %.1f on one, speedup %.2f \n",
+         elapsed > 0.0 ? nreplicas / elapsed : 0.0, nworkers,
+         serial > 0.0 ? nreplicas / serial : 0.0, elapsed > 0.0 ? serial / elapsed : 0.0);
+  munmap(res, nreplicas * sizeof(struct result));
+}
+#endif
+
+#if PARALLEL
+/********************** PARALLEL EXECUTION ***********************/
+/* A packet sent at time t arrives no earlier than t + 1 time unit.  So if */
+/* the earliest pending time anywhere is T, each partition can run up to  */
+/* T + 1 unit without hearing from the others: whatever they send it in   */
+/* that window arrives after it.  Every round, each thread runs its       */
+/* partitions through the window, then all of them take in what crossed  */
+/* over and agree on the next window.                                     */
+/**************************************************************************/
+
+/* the counters each thread keeps, which runparallel() sums: one more
+   counter means one more line in counters() and a larger NCOUNTERS */
+#define NCOUNTERS 14
+
+static pthread_barrier_t barrier;
+static long long totals[NCOUNTERS];  /* counts summed over the threads */
+static pthread_mutex_t totalslock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the calling thread's counters */
+static void counters(long long **c)
+{
+  c[0] = &window_full;
+  c[1] = &total_ACKs_received;
+  c[2] = &packets_resent;
+  c[3] = &new_ACKs;
+  c[4] = &packets_received;
+  c[5] = &messages_delivered;
+  c[6] = &nsim;
+  c[7] = &ntolayer3;
+  c[8] = &nlost;
+  c[9] = &ncorrupt;
+  c[10] = &bndropped;
+  c[11] = &ncrossed;
+  c[12] = &packets_recovered;
+  c[13] = &packets_refused;
+}
+
+static void enter(struct partition *p)
+{
+  part = p;
+  now = p->time;
+}
+
+static void leave(void)
+{
+  part->time = now;
+}
+
+/* earliest time anything is pending in the current partition */
+static simtime_t nextdue(void)
+{
+  simtime_t due = tw_next(&part->wheel);
+
+  if (part->evcount > 0 && part->evlist[0]->evtime < due)
+    due = part->evlist[0]->evtime;
+  return due;
+}
+
+static void *worker(void *arg)
+{
+  long long *c[NCOUNTERS];
+  simtime_t lookahead = units2ticks(1.0), next;
+  int k = (int)(long)arg, i;
+
+  for (;;) {
+    for (i = k; i < nparts; i += nthreads) {
+      enter(&parts[i]);
+      drainqueues();
+      part->next = nextdue();
+      leave();
+    }
+    pthread_barrier_wait(&barrier);
+
+    /* every thread works out the same window */
+    next = TW_NEVER;
+    for (i = 0; i < nparts; i++)
+      if (parts[i].next < next)
+        next = parts[i].next;
+    if (next == TW_NEVER)
+      break;
+    if (k == 0)
+      nwindows++;
+
+    for (i = k; i < nparts; i += nthreads) {
+      enter(&parts[i]);
+      while (step(next + lookahead))
+        ;
+      leave();
+    }
+    pthread_barrier_wait(&barrier);
+  }
+
+  counters(c);
+  pthread_mutex_lock(&totalslock);
+  for (i = 0; i < NCOUNTERS; i++)
+    totals[i] += *c[i];
+  pthread_mutex_unlock(&totalslock);
+  return NULL;
+}
+
+/* run the partitions on nthreads threads, the calling one included */
+static void runparallel(void)
+{
+  pthread_t threads[MAXPARTS];
+  long long *c[NCOUNTERS];
+  int i;
+
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  for (i = 0; i < NCOUNTERS; i++)
+    totals[i] = 0;
+  for (i = 1; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, worker, (void *)(long)i) != 0) {
+      printf("cannot start thread %d.\n", i);
+      exit(EXIT_FAILURE);
+    }
+  worker((void *)0);
+  for (i = 1; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&barrier);
+
+  counters(c);
+  for (i = 0; i < NCOUNTERS; i++)
+    *c[i] = totals[i];
+  now = 0;
+  for (i = 0; i < nparts; i++)
+    if (parts[i].time > now)
+      now = parts[i].time;
+}
+#endif
+
+int main(void)
+{
+  init();
+  if (TUNE) {
+    tune();
+    return EXIT_SUCCESS;
+  }
+#if REPLICAS
+  replicas();
+  return EXIT_SUCCESS;
+#endif
+  startrun(SEED);
+  for (curflow = 0; curflow < nflows; curflow++) {
+    A_init();
+    B_init();
+  }
+
+#if PARALLEL
+  runparallel();
+#else
+  while (step(TW_NEVER) && !stopnow)
+    ;
+#endif
+
+  printf(" Simulator terminated at time %f\n after attempting to send %lld msgs from layer5\n",ticks2units(now),nsim);
+  printf("number of messages dropped due to full window:  %lld \n", window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %lld \n", new_ACKs);
   printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
-  printf("number of packet resends by A:  %d \n", packets_resent);
-  printf("number of correct packets received at B:  %d \n", packets_received);
-  printf("number of messages delivered to application:  %d \n", messages_delivered);
+  printf("number of packet resends by A:  %lld \n", packets_resent);
+  printf("number of correct packets received at B:  %lld \n", packets_received);
+  if (FEC > 0)
+    printf("number of packets rebuilt from parity at B:  %lld \n", packets_recovered);
+  if (RCVBUF > 0)
+    printf("number of packets dropped for a full receive buffer at B:  %lld \n", packets_refused);
+  printf("number of messages delivered to application:  %lld \n", messages_delivered);
+  if (nparts == 1) {
+    printf("latency of delivered messages: p50 %f, p90 %f, p99 %f, max %f \n",
+           ticks2units(lh_quantile(&lathist, 0.50)), ticks2units(lh_quantile(&lathist, 0.90)),
+           ticks2units(lh_quantile(&lathist, 0.99)), ticks2units(lathist.max));
+    printf("number of spurious resends (an undamaged copy had reached B or was on its way):  %lld \n", nspurious);
+    printf("loss recovery time of %lld data packets: p50 %f, p90 %f, p99 %f, max %f \n", rechist.count,
+           ticks2units(lh_quantile(&rechist, 0.50)), ticks2units(lh_quantile(&rechist, 0.90)),
+           ticks2units(lh_quantile(&rechist, 0.99)), ticks2units(rechist.max));
+    if (RCVBUF > 0)
+      printf("most messages waiting in a receive buffer:  %lld (%lld bytes) \n", buffer_peak, 20 * buffer_peak);
+  }
+  if (MULTIFLOW)
+    printflows();
+  if (RELAYS)
+    printlinks();
+  if (PROFILE)
+    printprofile();
+  if (VERIFY)
+    printverify();
+  if (PARALLEL) {
+    printf("\npartitions:  %d, threads:  %d \n", nparts, nthreads);
+    printf("synchronisation windows:  %lld \n", nwindows);
+    printf("events handed between partitions:  %lld \n", ncrossed);
+  }
+  if (AUTOSTOP) {
+    if (stopnow)
+      printf("\nrun stopped: requested precision reached \n");
+    else
+      printf("\nrun ended before the requested precision was reached \n");
+    bm_report(&bm, precision);
+    bm_free(&bm);
+  }
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,15 +1,93 @@
+/* emulator options: 0 = off, 1 = on */
+#ifndef MULTIFLOW
+#define MULTIFLOW 0   /* many flows sharing a bottleneck link */
+#endif
+#ifndef AUTOSTOP
+#define AUTOSTOP 0    /* stop once goodput and latency are precise enough */
+#endif
+#ifndef PARALLEL
+#define PARALLEL 0    /* run partitions of the entities on several threads */
+#endif
+#ifndef PROFILE
+#define PROFILE 0     /* count what the emulator does, report progress on stderr */
+#endif
+#ifndef VERIFY
+#define VERIFY 0      /* check that layer 5 gets every message once, in order */
+#endif
+#ifndef ARRIVALS
+#define ARRIVALS 0    /* messages arrive: 0 uniform, 1 Poisson, 2 on/off, 3 from a trace file */
+#endif
+#ifndef RELAYS
+#define RELAYS 0      /* a chain of links joined by relays between A and B */
+#endif
+#ifndef TUNE
+#define TUNE 0        /* search the protocol's window and timeout: 1 for goodput, 2 for p99 latency */
+#endif
+#ifndef REPLICAS
+#define REPLICAS 0    /* parallel replications: many seeded runs on worker processes */
+#endif
+
+#if PARALLEL && AUTOSTOP
+#error "AUTOSTOP needs the sequential emulator"
+#endif
+#if PARALLEL && PROFILE
+#error "PROFILE needs the sequential emulator"
+#endif
+#if PARALLEL && ARRIVALS == 3
+#error "a trace file is replayed by the sequential emulator"
+#endif
+#if RELAYS && (PARALLEL || MULTIFLOW)
+#error "RELAYS runs one flow, or one per link, in the sequential emulator"
+#endif
+#if RELAYS && ARRIVALS == 3
+#error "a trace file names flows, which RELAYS uses for links"
+#endif
+#if TUNE && (PARALLEL || AUTOSTOP)
+#error "TUNE makes sequential runs of the number of messages entered"
+#endif
+#if REPLICAS && (PARALLEL || AUTOSTOP || TUNE)
+#error "REPLICAS makes sequential runs of the number of messages entered"
+#endif
+
+/* in parallel runs each thread keeps its own counters and flow selection */
+#if PARALLEL
+#define THREADLOCAL _Thread_local
+#else
+#define THREADLOCAL
+#endif
+
 extern int TRACE;
 
 /* statistics updated by GBN */
-extern int total_ACKs_received;
-extern int packets_resent;       /* count of the number of packets resent  */
-extern int new_ACKs;      /* count of the number of acks correctly received */
-extern int packets_received;  /* count of the packets received by receiver */
-extern int window_full; /* count of the number of messages dropped due to full window */
+extern THREADLOCAL long long total_ACKs_received;
+extern THREADLOCAL long long packets_resent;       /* count of the number of packets resent  */
+extern THREADLOCAL long long new_ACKs;      /* count of the number of acks correctly received */
+extern THREADLOCAL long long packets_received;  /* count of the packets received by receiver */
+extern THREADLOCAL long long packets_recovered; /* count of the packets the receiver rebuilt from parity */
+extern THREADLOCAL long long window_full; /* count of the number of messages dropped due to full window */
+extern THREADLOCAL long long packets_refused; /* count of the packets the receiver dropped for a full buffer */
+extern THREADLOCAL long long buffer_peak;     /* most messages waiting in any receive buffer */
 
 #define   A    0
 #define   B    1
 
+/* simulated time is counted in ticks of 1/TICKS_PER_UNIT time units.  The
+   prompts and the timer routines use time units */
+#ifndef TICKS_PER_UNIT
+#define TICKS_PER_UNIT 1000000
+#endif
+
+typedef long long simtime_t;
+
+extern simtime_t units2ticks(double);
+extern double ticks2units(simtime_t);
+
+/* the emulator runs nflows independent copies of A and B.  Before calling
+   any A_ or B_ routine it sets curflow to the flow concerned, so protocol
+   state must be kept per flow and indexed by curflow */
+extern int nflows;
+extern THREADLOCAL int curflow;
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
@@ -19,12 +97,19 @@ struct msg {
 
 /* a packet is the data unit passed from layer 4 (students code) to layer */
 /* 3 (teachers code).  Note the pre-defined packet structure, which all   */
-/* students must follow. */
+/* students must follow.  The payload holds MAXPAYLOAD bytes, by default  */
+/* just one message. */
+#ifndef MAXPAYLOAD
+#define MAXPAYLOAD 20
+#endif
+#if MAXPAYLOAD < 20
+#error "a packet must have room for a message: MAXPAYLOAD >= 20"
+#endif
 struct pkt {
   int seqnum;
   int acknum;
   int checksum;
-  char payload[20];
+  char payload[MAXPAYLOAD];
 };
 
 /* send to A or B (int), packet to send */
@@ -33,8 +118,17 @@ extern void tolayer3(int, struct pkt);
 /* deliver to A or B (int), data to deliver */
 extern void tolayer5(int, char[20]); 
 
-/* start timer at A or B (int), increment */
+/* start timer at A or B (int), increment in time units (rounded to a tick) */
 extern void starttimer(int, double);       
 
 /* stop timer at A or B (int) */
 extern void stoptimer(int);               
+
+/* any number of further timers may run at A or B, each named by an id
+   (int >= 0).  When one expires, A_timerinterrupt_id(id) or
+   B_timerinterrupt_id(id) is called */
+/* start timer at A or B (int), id (int), increment in time units */
+extern void starttimer_id(int, int, double);
+
+/* stop timer at A or B (int), id (int) */
+extern void stoptimer_id(int, int);
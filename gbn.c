@@ -20,13 +20,23 @@
    - removed bidirectional GBN code and other code not used by prac.
    - fixed C style to adhere to current programming style
    - added GBN implementation
+   - optional negative acknowledgements (NACK): B answers a packet it
+   cannot deliver with a NACK naming the one it is missing, once per
+   gap, and A resends at once instead of waiting for the timeout
+   - the options shared with sr.c, in arq.h: pacing, forward error
+   correction, aggregation, flow control, and a tunable window and timeout
 **********************************************************************/
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
+#ifndef WINDOWSIZE
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
                           MUST BE SET TO 6 when submitting assignment */
-#define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
+#endif
+#define SEQSPACE (WINDOWSIZE + 1)  /* the min sequence space for GBN must be at least windowsize + 1 */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
+#define PACETIMER 0     /* id of the pacer's timer */
+#define FLUSHTIMER 1  /* id of the timer that sends a part-filled packet */
+#define PROBETIMER 2  /* id of the timer of A's zero window probes */
 
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your
@@ -40,7 +50,7 @@ int ComputeChecksum(struct pkt packet)
 
   checksum = packet.seqnum;
   checksum += packet.acknum;
-  for ( i=0; i<20; i++ )
+  for ( i=0; i<MAXPAYLOAD; i++ )
     checksum += (int)(packet.payload[i]);
 
   return checksum;
@@ -54,49 +64,64 @@ bool IsCorrupted(struct pkt packet)
     return (true);
 }
 
+#include "arq.h"
+
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/* resend the whole window and time it again */
+static void goback(struct sender *s)
+{
+  int i, unsent = 0;
+
+  /* paced: the window goes again in order as tokens allow.  Packets still
+     waiting for their first send are the newest in the window */
+  if (PACEGAP > 0) {
+    for (i=0; i<s->queuecount; i++)
+      if (!s->queue[(s->queuefirst+i) % WINDOWSIZE].resend)
+        unsent++;
+    s->queuecount = 0;
+    for (i=0; i<s->windowcount; i++)
+      queuesend(s, s->buffer[(s->windowfirst+i) % WINDOWSIZE].seqnum,
+                i < s->windowcount - unsent);
+    if (s->windowcount > 0)
+      starttimer(A,A_timeout);
+    return;
+  }
+
+  for(i=0; i<s->windowcount; i++) {
+
+    if (TRACE > 0)
+      printf ("---A: resending packet %d\n", (s->buffer[(s->windowfirst+i) % WINDOWSIZE]).seqnum);
+
+    tolayer3(A,s->buffer[(s->windowfirst+i) % WINDOWSIZE]);
+    packets_resent++;
+    if (i==0) starttimer(A,A_timeout);
+  }
+}
+
+/* start timer if first packet in window */
+static void timenew(struct sender *s, int seqnum)
+{
+  if (s->windowcount == 1)
+    starttimer(A,A_timeout);
+}
 
 /* called from layer 5 (application layer), passed the message to be sent to other side */
 void A_output(struct msg message)
 {
-  struct pkt sendpkt;
-  int i;
+  struct sender *s = &senders[curflow];
+
+  if (MAXPAYLOAD > 20) {
+    aggregate(s, &message);
+    return;
+  }
 
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
+  if ( s->windowcount < sendwindow(s)) {
     if (TRACE > 1)
       printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
-
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ )
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
-
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
-
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
-
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
-
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+    sendnew(s, message.data);
   }
   /* if blocked,  window is full */
   else {
@@ -107,12 +132,15 @@ void A_output(struct msg message)
 }
 
 
+
 /* called from layer 3, when a packet arrives for layer 4
    In this practical this will always be an ACK as B never sends data.
 */
 void A_input(struct pkt packet)
 {
+  struct sender *s = &senders[curflow];
   int ackcount = 0;
+  int acknum;
   int i;
 
   /* if received ACK is not corrupted */
@@ -121,42 +149,64 @@ void A_input(struct pkt packet)
       printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
     total_ACKs_received++;
 
+    /* with a receive buffer B advertises its room in the seqnum */
+    if (RCVBUF > 0)
+      s->rwnd = packet.seqnum;
+
+    /* a NACK of n says B has every packet before n */
+    acknum = packet.acknum;
+    if (NACK && packet.payload[0] == NACKMARK)
+      acknum = (packet.acknum + SEQSPACE - 1) % SEQSPACE;
+
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
+    if (s->windowcount != 0) {
+          int seqfirst = s->buffer[s->windowfirst].seqnum;
+          int seqlast = s->buffer[s->windowlast].seqnum;
           /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
+          if (((seqfirst <= seqlast) && (acknum >= seqfirst && acknum <= seqlast)) ||
+              ((seqfirst > seqlast) && (acknum >= seqfirst || acknum <= seqlast))) {
 
             /* packet is a new ACK */
             if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
+              printf("----A: ACK %d is not a duplicate\n",acknum);
             new_ACKs++;
 
             /* cumulative acknowledgement - determine how many packets are ACKed */
-            if (packet.acknum >= seqfirst)
-              ackcount = packet.acknum + 1 - seqfirst;
+            if (acknum >= seqfirst)
+              ackcount = acknum + 1 - seqfirst;
             else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
+              ackcount = SEQSPACE - seqfirst + acknum;
 
 	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+            s->windowfirst = (s->windowfirst + ackcount) % WINDOWSIZE;
 
             /* delete the acked packets from window buffer */
             for (i=0; i<ackcount; i++)
-              windowcount--;
+              s->windowcount--;
+            s->nackseq = NOTINUSE;
 
 	    /* start timer again if there are still more unacked packets in window */
             stoptimer(A);
-            if (windowcount > 0)
-              starttimer(A, RTT);
-
+            if (s->windowcount > 0)
+              starttimer(A, A_timeout);
           }
         }
         else
           if (TRACE > 0)
         printf ("----A: duplicate ACK received, do nothing!\n");
+
+    acked(s);
+
+    /* go back to the NACKed packet, once until the next timeout */
+    if (NACK && packet.payload[0] == NACKMARK && s->windowcount > 0 &&
+        s->buffer[s->windowfirst].seqnum == packet.acknum &&
+        s->nackseq != packet.acknum) {
+      if (TRACE > 0)
+        printf("----A: NACK %d is received, resend packets!\n", packet.acknum);
+      stoptimer(A);
+      goback(s);
+      s->nackseq = packet.acknum;
+    }
   }
   else
     if (TRACE > 0)
@@ -166,98 +216,122 @@ void A_input(struct pkt packet)
 /* called when A's timer goes off */
 void A_timerinterrupt(void)
 {
-  int i;
+  struct sender *s = &senders[curflow];
 
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
 
-  for(i=0; i<windowcount; i++) {
-
-    if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
-
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
-    packets_resent++;
-    if (i==0) starttimer(A,RTT);
-  }
+  s->nackseq = NOTINUSE;
+  goback(s);
 }
 
+/* called when one of A's id timers goes off.  Go-Back-N times only the
+   oldest unacknowledged packet, with the plain timer, so these are all
+   the options' timers */
+void A_timerinterrupt_id(int id)
+{
+  optiontimer(&senders[curflow], id);
+}
 
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
+/* It is called once per flow, in flow order */
 void A_init(void)
 {
-  /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
-		     new packets are placed in winlast + 1
-		     so initially this is set to -1
-		   */
-  windowcount = 0;
+  if (curflow == 0) {
+    free(senders);
+    senders = malloc(nflows * sizeof(struct sender));
+    if (senders == NULL) {
+      printf("memory allocation for senders failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  initsender(&senders[curflow]);
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
-
-
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(struct pkt packet)
 {
+  struct receiver *r = &receivers[curflow];
   struct pkt sendpkt;
-  int i;
-
+  bool nack = false;
+  bool full;
+
+  /* B drops the packet it expects if it has no room for its messages,
+     just as if it had been lost */
+  full = !IsCorrupted(packet) && packet.seqnum == r->expectedseqnum &&
+         !room(r, messages(&packet));
+
+  /* keep every undamaged data packet for rebuilding its group */
+  if (FEC > 0 && !IsCorrupted(packet) && packet.seqnum >= 0)
+    r->got[packet.seqnum] = packet;
+
+  /* a parity packet is answered only if it stood in for a lost packet */
+  if (FEC > 0 && packet.seqnum <= PARITYSEQ) {
+    if (IsCorrupted(packet) || !rebuild(r, packet))
+      return;
+    sendpkt.acknum = (r->expectedseqnum + SEQSPACE - 1) % SEQSPACE;
+  }
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  else if  ( (!IsCorrupted(packet))  && (packet.seqnum == r->expectedseqnum) && !full ) {
     if (TRACE > 0)
       printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
     packets_received++;
 
     /* deliver to receiving application */
-    tolayer5(B, packet.payload);
+    deliver(r, &packet);
 
     /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    sendpkt.acknum = r->expectedseqnum;
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+    r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;
+    r->nacked = false;
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
     if (TRACE > 0)
       printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
+    if (full)
+      packets_refused++;
+    if (r->expectedseqnum == 0)
       sendpkt.acknum = SEQSPACE - 1;
     else
-      sendpkt.acknum = expectedseqnum - 1;
+      sendpkt.acknum = r->expectedseqnum - 1;
+
+    /* with SEQSPACE = WINDOWSIZE + 1 a packet ahead of expectedseqnum looks
+       just like an old duplicate, so any packet B cannot deliver starts a
+       gap; B NACKs it once, and the timeout covers a lost NACK or resend */
+    if (NACK && !r->nacked && !full && packet.seqnum != PROBESEQ) {
+      sendpkt.acknum = r->expectedseqnum;
+      nack = true;
+      r->nacked = true;
+    }
   }
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ )
-    sendpkt.payload[i] = '0';
-
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt);
-
-  /* send out packet */
-  tolayer3 (B, sendpkt);
+  /* send the ACK, or NACK */
+  sendack(r, &sendpkt, nack);
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
+/* It is called once per flow, in flow order */
 void B_init(void)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  if (curflow == 0) {
+    free(receivers);
+    receivers = malloc(nflows * sizeof(struct receiver));
+    if (receivers == NULL) {
+      printf("memory allocation for receivers failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  initreceiver(&receivers[curflow]);
 }
 
 /******************************************************************************
@@ -269,7 +343,14 @@ void B_output(struct msg message)
 {
 }
 
-/* called when B's timer goes off */
+/* called when B's timer goes off: the application takes the oldest
+   message waiting in the receive buffer */
 void B_timerinterrupt(void)
+{
+  drain(&receivers[curflow]);
+}
+
+/* called when one of B's id timers goes off */
+void B_timerinterrupt_id(int id)
 {
 }
@@ -1,11 +1,44 @@
+/* protocol options, settable on the command line */
+#ifndef PACEGAP
+#define PACEGAP 0.0     /* time units between paced sends at A, 0 = no pacing */
+#endif
+#ifndef PACEBURST
+#define PACEBURST 1     /* sends A may make back to back once the pacer has rested */
+#endif
+#ifndef NACK
+#define NACK 0          /* 1 = B names a missing packet at once, A resends it */
+#endif
+#ifndef FEC
+#define FEC 0           /* data packets per XOR parity packet, 0 = no parity */
+#endif
+#ifndef FLUSHDELAY
+#define FLUSHDELAY 2.0  /* time units a part-filled packet waits for more messages */
+#endif
+#ifndef RCVBUF
+#define RCVBUF 0        /* messages B's receive buffer holds, 0 = its application takes each at once */
+#endif
+#ifndef DRAINGAP
+#define DRAINGAP 1.0    /* time units B's application takes over each buffered message */
+#endif
+#ifndef FLOWCONTROL
+#define FLOWCONTROL 1   /* 1 = A keeps within the room B advertises in its buffer */
+#endif
+
+/* the window and retransmission timeout A uses, WINDOWSIZE and RTT unless
+   a tuning run sets them.  The window may not exceed WINDOWSIZE */
+extern int A_window;
+extern double A_timeout;
+
 extern void A_init(void);
 extern void B_init(void);
 extern void A_input(struct pkt);
 extern void B_input(struct pkt);
 extern void A_output(struct msg);
 extern void A_timerinterrupt(void);
+extern void A_timerinterrupt_id(int);
 
 /* included for extension to bidirectional communication */
 #define BIDIRECTIONAL 0       /*  0 = A->B  1 =  A<->B */
 extern void B_output(struct msg);
-extern void B_timerinterrupt(void);
\ No newline at end of file
+extern void B_timerinterrupt(void);
+extern void B_timerinterrupt_id(int);
\ No newline at end of file
@@ -0,0 +1,549 @@
+/* ******************************************************************
+   SHARED-MEMORY BACKEND
+
+   Runs the protocol code (gbn.c or sr.c) with A and B in two separate
+   processes, each pinned to its own core.  Packets travel through a
+   shared-memory segment holding two lock-free single-producer/single-
+   consumer rings, one per direction, so the transport costs little more
+   than a cache-line transfer and the run measures the protocol state
+   machines themselves.
+   - tolayer3() copies the packet into the ring towards the other side,
+   after optional software loss and corruption as in the emulator.  A
+   full ring loses the packet, as a drop-tail queue would.
+   - each process polls its incoming ring and takes up to a batch of
+   packets at a time, publishing the new head once per batch.  When the
+   ring is empty it either spins (busy-poll) or yields the CPU.
+   - timers run in a timing wheel (twheel.c) per process, ticking in
+   nanoseconds of the monotonic clock.
+   - A is offered messages as fast as it accepts them; after a refusal
+   the next offer waits until A has taken in a packet or a timer.
+
+   One time unit, as used by starttimer(), is a number of microseconds
+   given at start-up.  The run ends once nsimmax messages have been
+   offered and B has delivered every accepted one.  Each side reports the
+   CPU cycles (time-stamp counter, or nanoseconds where there is none) it
+   spent per packet taken in, both handling packets and in total.
+
+   Linux only.  Build with
+       gcc -O2 -o gbn-shm shmemu.c twheel.c gbn.c -lm
+**********************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "emulator.h"
+#include "gbn.h"
+#include "twheel.h"
+
+#if MULTIFLOW || AUTOSTOP || PARALLEL
+#error "the shared-memory backend runs a single flow in real time"
+#endif
+
+#define RINGSIZE 1024             /* packets per ring, a power of two */
+
+/* a ring of packets from one process to the other.  The producer fills
+   slots at tail and the consumer empties them at head; each index is
+   written by one side only and sits on its own cache line */
+struct ring {
+  _Alignas(64) _Atomic unsigned long head;
+  _Alignas(64) _Atomic unsigned long tail;
+  _Alignas(64) struct pkt slot[RINGSIZE];
+};
+
+/* the shared segment.  B leaves its counters here when it finishes */
+struct shared {
+  struct ring ring[2];            /* ring[A] carries packets from A to B */
+  _Atomic long long delivered;    /* messages B has delivered */
+  _Atomic int stop;               /* set by A when the run is over */
+  long long packets_received;
+  long long packets_recovered;
+  long long packets_refused, buffer_peak;
+  long long messages_delivered;
+  long long ntolayer3, nlost, ncorrupt, nfull;
+  long long ntaken;               /* packets B took from its ring */
+  unsigned long long busy, total; /* B's cycles handling packets, in all */
+};
+
+int TRACE = 0;
+
+/* statistics updated by GBN */
+long long window_full;
+long long total_ACKs_received;
+long long packets_resent;
+long long new_ACKs;
+long long packets_received;
+long long packets_recovered;
+long long packets_refused;
+long long buffer_peak;
+
+int nflows = 1;
+int curflow = 0;
+
+/* statistics of this process */
+static long long messages_delivered;
+static long long nsim = 0;        /* messages offered to A so far */
+static long long nsimmax = 0;     /* number of msgs to offer, then stop */
+static long long naccepted = 0;   /* messages A took */
+static long long ntolayer3;       /* number sent into layer 3 */
+static long long nlost;           /* number lost in software */
+static long long ncorrupt;        /* number corrupted in software */
+static long long nfull;           /* packets lost to a full ring */
+static long long ntaken;          /* packets taken from the incoming ring */
+static unsigned long long busy;   /* cycles spent handling packets */
+
+static float lossprob;            /* probability that a packet is dropped  */
+static float corruptprob;         /* probability that one bit is packet is flipped */
+static int corruptdirection;      /* A->B A<-B or bidirectional corruption/loss */
+static double usperunit;          /* microseconds in one time unit */
+static int batch;                 /* most packets taken from a ring at once */
+static int busypoll;              /* spin on an empty ring instead of yielding */
+static int cpu[2];                /* cores for A and B, -1 to leave unpinned */
+
+static struct shared *shm;
+static int self;                  /* A or B: the entity this process runs */
+static unsigned long headseen;    /* producer: head of the outgoing ring as last read */
+static struct timespec start;     /* wall-clock time of the start */
+
+static struct twheel wheel;       /* running timers */
+static struct twtimer *twfree;    /* unused timers */
+static struct twtimer *timer[2];  /* running starttimer() timer of A and B */
+static struct twtimer **idtimer[2];  /* running starttimer_id() timers, by id */
+static int nidtimer[2];           /* size of idtimer[] */
+
+/* time units are scaled to nanoseconds of wall-clock time */
+simtime_t units2ticks(double units)
+{
+  return ((simtime_t)(units * usperunit * 1000.0 + 0.5));
+}
+
+double ticks2units(simtime_t ticks)
+{
+  return ((double)ticks / (usperunit * 1000.0));
+}
+
+static simtime_t clocknow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((simtime_t)(ts.tv_sec - start.tv_sec) * 1000000000LL + (ts.tv_nsec - start.tv_nsec));
+}
+
+static unsigned long long cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return (__rdtsc());
+#else
+  return ((unsigned long long)clocknow());
+#endif
+}
+
+double jimsrand(void)
+{
+  double mmm = RAND_MAX;
+  return (rand() / mmm);
+}
+
+void init(void)
+{
+  printf("-----  Shared-memory ring backend -------- \n\n");
+  printf("Enter the number of messages to send: ");
+  scanf("%lld",&nsimmax);
+  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+  scanf("%f",&lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%f",&corruptprob);
+  if (lossprob != 0.0 || corruptprob != 0.0) {
+    printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
+    scanf("%d",&corruptdirection);
+  }
+  printf("Enter the length of a time unit in microseconds [e.g. 1000]:");
+  scanf("%lf",&usperunit);
+  printf("Enter the most packets to take from a ring at once [e.g. 32]:");
+  scanf("%d",&batch);
+  printf("Busy-poll an empty ring (1) or yield the CPU (0):");
+  scanf("%d",&busypoll);
+  printf("Enter the cores for A and B [-1 -1 to leave them unpinned]:");
+  scanf("%d %d",&cpu[A],&cpu[B]);
+  printf("Enter TRACE:");
+  scanf("%d",&TRACE);
+
+  if (nsimmax < 0 || usperunit <= 0.0 || batch < 1) {
+    printf("Invalid message count, time unit or batch size.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  shm = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shm == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  memset(shm, 0, sizeof(struct shared));
+  fflush(stdout);
+}
+
+/* run the calling process on core c */
+static void pin(int c)
+{
+  cpu_set_t set;
+
+  if (c < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(c, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    printf("Warning: cannot pin %c to core %d, left unpinned\n", self == A ? 'A' : 'B', c);
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+static struct twtimer **timerslot(int AorB, int id)
+{
+  int i, n;
+
+  if (id < 0)
+    return (&timer[AorB]);
+  if (id >= nidtimer[AorB]) {
+    n = nidtimer[AorB] ? nidtimer[AorB] : 8;
+    while (n <= id)
+      n *= 2;
+    idtimer[AorB] = realloc(idtimer[AorB], n * sizeof(struct twtimer *));
+    if (idtimer[AorB] == 0) {
+      printf("memory allocation for timers failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i = nidtimer[AorB]; i < n; i++)
+      idtimer[AorB][i] = NULL;
+    nidtimer[AorB] = n;
+  }
+  return (&idtimer[AorB][id]);
+}
+
+static void armtimer(int AorB, int id, double increment)
+{
+  struct twtimer **slot = timerslot(AorB, id);
+  struct twtimer *t;
+
+  if (*slot != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  t = twfree;
+  if (t != NULL)
+    twfree = t->next;
+  else if ((t = malloc(sizeof(struct twtimer))) == 0) {
+    printf("memory allocation for timers failed.");
+    exit(EXIT_FAILURE);
+  }
+  t->flow = 0;
+  t->entity = AorB;
+  t->id = id;
+  *slot = t;
+  tw_add(&wheel, t, clocknow() + units2ticks(increment));
+}
+
+static void disarmtimer(int AorB, int id)
+{
+  struct twtimer **slot = timerslot(AorB, id);
+
+  if (*slot == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  tw_cancel(&wheel, *slot);
+  (*slot)->next = twfree;
+  twfree = *slot;
+  *slot = NULL;
+}
+
+void stoptimer(int AorB)
+{
+  disarmtimer(AorB, -1);
+}
+
+void starttimer(int AorB, double increment)
+{
+  armtimer(AorB, -1, increment);
+}
+
+void stoptimer_id(int AorB, int id)
+{
+  disarmtimer(AorB, id);
+}
+
+void starttimer_id(int AorB, int id, double increment)
+{
+  if (id < 0) {
+    printf("Warning: timer ids must not be negative\n");
+    return;
+  }
+  armtimer(AorB, id, increment);
+}
+
+static void timerinterrupt(struct twtimer *t)
+{
+  int AorB = t->entity, id = t->id;
+
+  *timerslot(AorB, id) = NULL;
+  t->next = twfree;
+  twfree = t;
+
+  if (id < 0) {
+    if (AorB == A)
+      A_timerinterrupt();
+    else
+      B_timerinterrupt();
+  }
+  else {
+    if (AorB == A)
+      A_timerinterrupt_id(id);
+    else
+      B_timerinterrupt_id(id);
+  }
+}
+
+/************************** TOLAYER3 ***************/
+void tolayer3(int AorB, struct pkt packet)
+{
+  struct ring *r = &shm->ring[AorB];
+  unsigned long tail;
+  float x;
+
+  ntolayer3++;
+
+  /* simulate losses: */
+  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+    nlost++;
+    return;
+  }
+
+  /* simulate corruption: */
+  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+    ncorrupt++;
+    if ( (x = jimsrand()) < .75)
+      packet.payload[0]='Z';   /* corrupt payload */
+    else if (x < .875)
+      packet.seqnum = 999999;
+    else
+      packet.acknum = 999999;
+  }
+
+  /* the head is read again only when the ring looks full */
+  tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  if (tail - headseen == RINGSIZE) {
+    headseen = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - headseen == RINGSIZE) {
+      nfull++;
+      return;
+    }
+  }
+  r->slot[tail & (RINGSIZE - 1)] = packet;
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  int i;
+
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at %c: ", AorB == A ? 'A' : 'B');
+    for (i=0; i<20; i++)
+      printf("%c",datasent[i]);
+    printf("\n");
+  }
+  messages_delivered++;
+  atomic_store_explicit(&shm->delivered, messages_delivered, memory_order_release);
+}
+
+/* take up to a batch of packets from the ring into this process and hand
+   them to the entity.  Returns the number taken */
+static int receive(void)
+{
+  struct ring *r = &shm->ring[1 - self];
+  struct pkt packet;
+  unsigned long head, tail;
+  int i, n;
+
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  n = tail - head < (unsigned long)batch ? (int)(tail - head) : batch;
+  for (i = 0; i < n; i++) {
+    packet = r->slot[(head + i) & (RINGSIZE - 1)];
+    if (self == A)
+      A_input(packet);
+    else
+      B_input(packet);
+  }
+  if (n > 0)
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+  ntaken += n;
+  return n;
+}
+
+/* fire every expired timer.  Returns the number fired */
+static int expire(void)
+{
+  struct twtimer *t;
+  simtime_t now;
+  int n = 0;
+
+  if (wheel.count == 0)
+    return 0;
+  now = clocknow();
+  while ((t = tw_pop(&wheel, now)) != NULL) {
+    timerinterrupt(t);
+    n++;
+  }
+  return n;
+}
+
+/* offer the next message to A.  Returns 0 if A refused it */
+static int offer(void)
+{
+  struct msg msg2give;
+  long long refused = window_full;
+  int i;
+
+  for (i=0; i<20; i++)
+    msg2give.data[i] = 97 + nsim % 26;
+  nsim++;
+  A_output(msg2give);
+  if (window_full != refused)
+    return 0;
+  naccepted++;
+  return 1;
+}
+
+static void idle(void)
+{
+  if (!busypoll)
+    sched_yield();
+}
+
+static void runA(void)
+{
+  unsigned long long t0;
+  int blocked = 0, n;
+
+  while (nsim < nsimmax ||
+         atomic_load_explicit(&shm->delivered, memory_order_acquire) < naccepted) {
+    t0 = cycles();
+    n = receive() + expire();
+    if (n > 0)
+      blocked = 0;
+    while (nsim < nsimmax && !blocked) {
+      blocked = !offer();
+      n++;
+    }
+    if (n > 0)
+      busy += cycles() - t0;
+    else
+      idle();
+  }
+  atomic_store_explicit(&shm->stop, 1, memory_order_release);
+}
+
+static void runB(void)
+{
+  unsigned long long t0;
+
+  while (!atomic_load_explicit(&shm->stop, memory_order_acquire)) {
+    t0 = cycles();
+    if (receive() + expire() > 0)
+      busy += cycles() - t0;
+    else
+      idle();
+  }
+}
+
+static void report(const char *side, long long taken, unsigned long long busycycles,
+                   unsigned long long totalcycles)
+{
+  printf("%s: packets taken in %lld, cycles per packet: handling %.1f, in all %.1f \n", side, taken,
+         taken > 0 ? (double)busycycles / taken : 0.0, taken > 0 ? (double)totalcycles / taken : 0.0);
+}
+
+int main(void)
+{
+  unsigned long long c0, total;
+  double elapsed;
+  pid_t child;
+  int status;
+
+  init();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  child = fork();
+  if (child < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  self = child == 0 ? B : A;
+  srand(9999 + self);
+  tw_init(&wheel, 0);
+  pin(cpu[self]);
+  if (self == A)
+    A_init();
+  else
+    B_init();
+
+  c0 = cycles();
+  if (self == B) {
+    runB();
+    shm->total = cycles() - c0;
+    shm->busy = busy;
+    shm->ntaken = ntaken;
+    shm->packets_received = packets_received;
+    shm->packets_recovered = packets_recovered;
+    shm->packets_refused = packets_refused;
+    shm->buffer_peak = buffer_peak;
+    shm->messages_delivered = messages_delivered;
+    shm->ntolayer3 = ntolayer3;
+    shm->nlost = nlost;
+    shm->ncorrupt = ncorrupt;
+    shm->nfull = nfull;
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+  }
+  runA();
+  total = cycles() - c0;
+  elapsed = clocknow() / 1e9;
+  if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) {
+    printf("process B did not finish.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf(" Run ended after %f seconds\n after attempting to send %lld msgs from layer5\n", elapsed, nsim);
+  printf("number of messages dropped due to full window:  %lld \n", window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %lld \n", new_ACKs);
+  printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
+  printf("number of packet resends by A:  %lld \n", packets_resent);
+  printf("number of correct packets received at B:  %lld \n", shm->packets_received);
+  if (FEC > 0)
+    printf("number of packets rebuilt from parity at B:  %lld \n", shm->packets_recovered);
+  if (RCVBUF > 0) {
+    printf("number of packets dropped for a full receive buffer at B:  %lld \n", shm->packets_refused);
+    printf("most messages waiting in a receive buffer:  %lld (%lld bytes) \n",
+           shm->buffer_peak, 20 * shm->buffer_peak);
+  }
+  printf("number of messages delivered to application:  %lld \n", shm->messages_delivered);
+  printf("number of packets sent into layer 3:  %lld \n", ntolayer3 + shm->ntolayer3);
+  printf("number of packets lost, corrupted in software:  %lld, %lld \n",
+         nlost + shm->nlost, ncorrupt + shm->ncorrupt);
+  printf("number of packets lost to a full ring:  %lld \n", nfull + shm->nfull);
+  printf("messages delivered per second:  %.0f \n", elapsed > 0 ? shm->messages_delivered / elapsed : 0.0);
+  report("A", ntaken, busy, total);
+  report("B", shm->ntaken, shm->busy, shm->total);
+  munmap(shm, sizeof(struct shared));
+  return EXIT_SUCCESS;
+}
@@ -20,18 +20,27 @@
    - removed bidirectional GBN code and other code not used by prac.
    - fixed C style to adhere to current programming style
    - added GBN implementation
+   - made it Selective Repeat: A times every packet and resends only the
+   one whose timer goes off, and B holds undamaged packets ahead of the
+   one it expects, ACKs each packet it has on its own, and delivers in order
+   - optional negative acknowledgements (NACK): B answers a packet it
+   cannot deliver with a NACK naming the one it is missing, once per
+   gap, and A resends at once instead of waiting for the timeout
+   - the options shared with gbn.c, in arq.h: pacing, forward error
+   correction, aggregation, flow control, and a tunable window and timeout
 **********************************************************************/
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
+#ifndef WINDOWSIZE
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
                           MUST BE SET TO 6 when submitting assignment */
+#endif
 				  
 #define SEQSPACE    (2 * WINDOWSIZE)  // Sequence number space: twice the window size
-
-static struct pkt sr_buffer[SEQSPACE];  // Buffer for packets sent but not yet ACKed
-static bool    sr_acked[SEQSPACE];      // ACK flags for each sequence number
-static double  sr_expiry[SEQSPACE];     // Simulated timeout timestamp for each packet
-static int     base, nextseqnum;        // Sender window’s left edge (base) and next sequence number
+#define NOTINUSE    (-1)   // used to fill header fields that are not being used
+#define PACETIMER   SEQSPACE  // id of the pacer's timer, after the packets' timers
+#define FLUSHTIMER  (SEQSPACE + 1)  // id of the timer that sends a part-filled packet
+#define PROBETIMER  (SEQSPACE + 2)  // id of the timer of A's zero window probes
 
 
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
@@ -46,7 +55,7 @@ int ComputeChecksum(struct pkt packet)
 
   checksum = packet.seqnum;
   checksum += packet.acknum;
-  for ( i=0; i<20; i++ )
+  for ( i=0; i<MAXPAYLOAD; i++ )
     checksum += (int)(packet.payload[i]);
 
   return checksum;
@@ -60,49 +69,45 @@ bool IsCorrupted(struct pkt packet)
     return (true);
 }
 
+#include "arq.h"
+
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/* every packet has its own timer, named by its sequence number */
+static void timenew(struct sender *s, int seqnum)
+{
+  starttimer_id(A, seqnum, A_timeout);
+}
+
+/* B has the packet i places into the window, which needs no more timing.
+   Returns false if B was already known to have it */
+static bool sack(struct sender *s, int i)
+{
+  int slot = (s->windowfirst + i) % WINDOWSIZE;
+
+  if (s->sacked[slot])
+    return false;
+  s->sacked[slot] = true;
+  stoptimer_id(A, s->buffer[slot].seqnum);
+  return true;
+}
 
 /* called from layer 5 (application layer), passed the message to be sent to other side */
 void A_output(struct msg message)
 {
-  struct pkt sendpkt;
-  int i;
+  struct sender *s = &senders[curflow];
+
+  if (MAXPAYLOAD > 20) {
+    aggregate(s, &message);
+    return;
+  }
 
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
+  if ( s->windowcount < sendwindow(s)) {
     if (TRACE > 1)
       printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
-
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ )
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
-
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
-
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
-
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
-
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+    sendnew(s, message.data);
   }
   /* if blocked,  window is full */
   else {
@@ -113,12 +118,16 @@ void A_output(struct msg message)
 }
 
 
+
 /* called from layer 3, when a packet arrives for layer 4
    In this practical this will always be an ACK as B never sends data.
 */
 void A_input(struct pkt packet)
 {
+  struct sender *s = &senders[curflow];
   int ackcount = 0;
+  int fresh = 0;
+  int acknum;
   int i;
 
   /* if received ACK is not corrupted */
@@ -127,143 +136,269 @@ void A_input(struct pkt packet)
       printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
     total_ACKs_received++;
 
-    /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
-          /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
+    /* with a receive buffer B advertises its room in the seqnum */
+    if (RCVBUF > 0)
+      s->rwnd = packet.seqnum;
+
+    /* a NACK of n says B has every packet before n, an ACK of n only n */
+    acknum = packet.acknum;
+    if (NACK && packet.payload[0] == NACKMARK)
+      acknum = (packet.acknum + SEQSPACE - 1) % SEQSPACE;
 
+    /* check if new ACK or duplicate */
+    if (s->windowcount != 0) {
+          int seqfirst = s->buffer[s->windowfirst].seqnum;
+          int seqlast = s->buffer[s->windowlast].seqnum;
+
+          if (NACK && packet.payload[0] == NACKMARK) {
+            /* check case when seqnum has and hasn't wrapped */
+            if (((seqfirst <= seqlast) && (acknum >= seqfirst && acknum <= seqlast)) ||
+                ((seqfirst > seqlast) && (acknum >= seqfirst || acknum <= seqlast))) {
+              /* cumulative acknowledgement - determine how many packets are ACKed */
+              if (acknum >= seqfirst)
+                ackcount = acknum + 1 - seqfirst;
+              else
+                ackcount = SEQSPACE - seqfirst + acknum;
+              for (i=0; i<ackcount; i++)
+                fresh += sack(s, i);
+            }
+          }
+          else
+            for (i=0; i<s->windowcount; i++)
+              if (s->buffer[(s->windowfirst+i) % WINDOWSIZE].seqnum == acknum) {
+                fresh += sack(s, i);
+                break;
+              }
+
+          if (fresh > 0) {
             /* packet is a new ACK */
             if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
+              printf("----A: ACK %d is not a duplicate\n",acknum);
             new_ACKs++;
 
-            /* cumulative acknowledgement - determine how many packets are ACKed */
-            if (packet.acknum >= seqfirst)
-              ackcount = packet.acknum + 1 - seqfirst;
-            else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
-
-	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
-
-            /* delete the acked packets from window buffer */
-            for (i=0; i<ackcount; i++)
-              windowcount--;
-
-	    /* start timer again if there are still more unacked packets in window */
-            stoptimer(A);
-            if (windowcount > 0)
-              starttimer(A, RTT);
-
+	    /* slide window past the packets B has */
+            while (s->windowcount > 0 && s->sacked[s->windowfirst]) {
+              s->sacked[s->windowfirst] = false;
+              s->windowfirst = (s->windowfirst + 1) % WINDOWSIZE;
+              s->windowcount--;
+            }
+            s->nackseq = NOTINUSE;
+
+            /* while ACKs come back the packets still out are not yet
+               overdue: the channel is only slow.  Each is timed again from
+               now, and resent only A_timeout after the last sign of progress */
+            for (i=0; i<s->windowcount; i++)
+              if (!s->sacked[(s->windowfirst+i) % WINDOWSIZE]) {
+                stoptimer_id(A, s->buffer[(s->windowfirst+i) % WINDOWSIZE].seqnum);
+                starttimer_id(A, s->buffer[(s->windowfirst+i) % WINDOWSIZE].seqnum, A_timeout);
+              }
           }
         }
         else
           if (TRACE > 0)
         printf ("----A: duplicate ACK received, do nothing!\n");
+
+    acked(s);
+
+    /* resend the NACKed packet, once until its next timeout */
+    if (NACK && packet.payload[0] == NACKMARK && s->windowcount > 0 &&
+        s->buffer[s->windowfirst].seqnum == packet.acknum &&
+        s->nackseq != packet.acknum) {
+      if (TRACE > 0)
+        printf("----A: NACK %d is received, resending packet %d\n", packet.acknum, packet.acknum);
+      if (PACEGAP > 0)
+        queuesend(s, packet.acknum, true);
+      else {
+        tolayer3(A, s->buffer[s->windowfirst]);
+        packets_resent++;
+      }
+      stoptimer_id(A, packet.acknum);
+      starttimer_id(A, packet.acknum, A_timeout);
+      s->nackseq = packet.acknum;
+    }
   }
   else
     if (TRACE > 0)
       printf ("----A: corrupted ACK is received, do nothing!\n");
 }
 
-/* called when A's timer goes off */
+/* called when A's timer goes off.  A only uses its per-packet timers */
 void A_timerinterrupt(void)
 {
-  int i;
-
-  if (TRACE > 0)
-    printf("----A: time out,resend packets!\n");
-
-  for(i=0; i<windowcount; i++) {
+}
 
-    if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
+/* called when the timer of the packet with sequence number seq goes off:
+   resend that packet only.  The options' timers come after the packets' */
+void A_timerinterrupt_id(int seq)
+{
+  struct sender *s = &senders[curflow];
+  int i;
 
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
-    packets_resent++;
-    if (i==0) starttimer(A,RTT);
-  }
+  if (optiontimer(s, seq))
+    return;
+
+  for(i=0; i<s->windowcount; i++)
+    if (s->buffer[(s->windowfirst+i) % WINDOWSIZE].seqnum == seq) {
+      if (TRACE > 0)
+        printf ("----A: time out, resending packet %d\n", seq);
+      if (seq == s->nackseq)
+        s->nackseq = NOTINUSE;
+
+      if (PACEGAP > 0)
+        queuesend(s, seq, true);
+      else {
+        tolayer3(A,s->buffer[(s->windowfirst+i) % WINDOWSIZE]);
+        packets_resent++;
+      }
+      starttimer_id(A, seq, A_timeout);
+      return;
+    }
 }
 
 
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
+/* It is called once per flow, in flow order */
 void A_init(void)
 {
-  /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
-		     new packets are placed in winlast + 1
-		     so initially this is set to -1
-		   */
-  windowcount = 0;
+  if (curflow == 0) {
+    free(senders);
+    senders = malloc(nflows * sizeof(struct sender));
+    if (senders == NULL) {
+      printf("memory allocation for senders failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  initsender(&senders[curflow]);
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
-
+/* deliver the packets B holds that are now in order */
+static void deliverheld(struct receiver *r)
+{
+  while (r->held[r->expectedseqnum]) {
+    unhold(r, r->expectedseqnum);
+    packets_received++;
+    deliver(r, &r->got[r->expectedseqnum]);
+    r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;
+  }
+}
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(struct pkt packet)
 {
+  struct receiver *r = &receivers[curflow];
   struct pkt sendpkt;
-  int i;
-
+  bool nack = false;
+  bool gap = false;
+  bool inwindow, full;
+  int rebuilt;
+
+  /* B's window is the WINDOWSIZE sequence numbers from expectedseqnum on.
+     It drops a packet of its window if it has no room for its messages
+     and those of the packets it holds, just as if it had been lost */
+  inwindow = !IsCorrupted(packet) && packet.seqnum >= 0 &&
+             (packet.seqnum - r->expectedseqnum + SEQSPACE) % SEQSPACE < WINDOWSIZE;
+  full = inwindow && !r->held[packet.seqnum] && !room(r, messages(&packet));
+
+  /* keep every undamaged data packet for rebuilding its group */
+  if (FEC > 0 && !IsCorrupted(packet) && packet.seqnum >= 0)
+    r->got[packet.seqnum] = packet;
+
+  /* a parity packet is answered only if it stood in for a lost packet */
+  if (FEC > 0 && packet.seqnum <= PARITYSEQ) {
+    rebuilt = r->expectedseqnum;
+    if (IsCorrupted(packet) || !rebuild(r, packet))
+      return;
+    sendpkt.acknum = rebuilt;
+    deliverheld(r);
+  }
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  else if (inwindow && !full && packet.seqnum == r->expectedseqnum) {
     if (TRACE > 0)
       printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
     packets_received++;
 
-    /* deliver to receiving application */
-    tolayer5(B, packet.payload);
+    /* deliver to receiving application, with the packets held behind it */
+    deliver(r, &packet);
+    r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;
+    r->nacked = false;
+    deliverheld(r);
 
     /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
-
-    /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+    sendpkt.acknum = packet.seqnum;
+  }
+  /* a packet ahead of a gap is held until the gap fills, and ACKed */
+  else if (inwindow && !full) {
+    if (!r->held[packet.seqnum]) {
+      if (TRACE > 0)
+        printf("----B: packet %d is ahead of %d, hold it and send ACK!\n",
+               packet.seqnum, r->expectedseqnum);
+      r->got[packet.seqnum] = packet;
+      r->held[packet.seqnum] = true;
+      r->heldmsgs += messages(&packet);
+    }
+    sendpkt.acknum = packet.seqnum;
+    gap = true;
+  }
+  /* an undamaged packet from before the window is one B has delivered,
+     whose ACK was lost: ACK it again */
+  else if (!IsCorrupted(packet) && packet.seqnum >= 0 && !full) {
+    if (TRACE > 0)
+      printf("----B: packet %d is a duplicate, resend ACK!\n",packet.seqnum);
+    sendpkt.acknum = packet.seqnum;
   }
   else {
-    /* packet is corrupted or out of order resend last ACK */
+    /* packet is corrupted, or there is no room for it: resend last ACK */
     if (TRACE > 0)
-      printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
+      printf("----B: packet corrupted or no room for it, resend ACK!\n");
+    if (full)
+      packets_refused++;
+    if (r->expectedseqnum == 0)
       sendpkt.acknum = SEQSPACE - 1;
     else
-      sendpkt.acknum = expectedseqnum - 1;
+      sendpkt.acknum = r->expectedseqnum - 1;
+
+    /* a damaged packet may be one B is missing, which a zero window probe
+       is not.  B NACKs each gap once; the timeout covers a lost NACK or
+       resend */
+    if (NACK && !r->nacked && !full && packet.seqnum != PROBESEQ &&
+        IsCorrupted(packet)) {
+      sendpkt.acknum = r->expectedseqnum;
+      nack = true;
+      r->nacked = true;
+    }
   }
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
+  /* send the ACK, or NACK */
+  sendack(r, &sendpkt, nack);
 
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ )
-    sendpkt.payload[i] = '0';
-
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt);
-
-  /* send out packet */
-  tolayer3 (B, sendpkt);
+  /* a packet held ahead of a gap also NACKs the gap, once */
+  if (NACK && gap && !r->nacked) {
+    sendpkt.acknum = r->expectedseqnum;
+    sendack(r, &sendpkt, true);
+    r->nacked = true;
+  }
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
+/* It is called once per flow, in flow order */
 void B_init(void)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  if (curflow == 0) {
+    free(receivers);
+    receivers = malloc(nflows * sizeof(struct receiver));
+    if (receivers == NULL) {
+      printf("memory allocation for receivers failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  initreceiver(&receivers[curflow]);
 }
 
 /******************************************************************************
@@ -275,7 +410,14 @@ void B_output(struct msg message)
 {
 }
 
-/* called when B's timer goes off */
+/* called when B's timer goes off: the application takes the oldest
+   message waiting in the receive buffer */
 void B_timerinterrupt(void)
+{
+  drain(&receivers[curflow]);
+}
+
+/* called when one of B's id timers goes off */
+void B_timerinterrupt_id(int id)
 {
 }
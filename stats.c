@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "stats.h"
+
+/* ******************************************************************
+   Output analysis for the emulator.
+
+   Every delivery to layer 5 is recorded with its latency.  Deliveries
+   are grouped into mini-batches of a fixed size, and only the mini-batch
+   means are kept.  When enough mini-batches exist:
+   - the warm-up is found with the MSER rule: discard the prefix that
+   minimises the variance of the remaining mean, considering at most
+   half of the series
+   - the rest is combined into BM_BATCHES equal batches, and goodput
+   and mean latency get a 95% batch-means confidence interval
+   The test is repeated each time the series grows by a quarter, so the
+   total cost stays linear in the number of mini-batches.
+**********************************************************************/
+
+#define T_975 2.045     /* Student t, 0.975 quantile, BM_BATCHES-1 degrees of freedom */
+
+void bm_init(struct batchmeans *bm, int size)
+{
+  bm->size = size;
+  bm->count = 0;
+  bm->latsum = 0.0;
+  bm->start = 0.0;
+  bm->lat = bm->span = bm->begin = NULL;
+  bm->n = bm->allocated = 0;
+  bm->nextcheck = 2 * BM_BATCHES;
+  bm->warmup = 0;
+  bm->goodput = bm->goodput_hw = 0.0;
+  bm->latency = bm->latency_hw = 0.0;
+}
+
+void bm_free(struct batchmeans *bm)
+{
+  free(bm->lat);
+  free(bm->span);
+  free(bm->begin);
+  bm->lat = bm->span = bm->begin = NULL;
+  bm->n = bm->allocated = 0;
+}
+
+/* record one delivery at time t with the given latency.  Returns 1 when a
+   new estimate is due */
+int bm_add(struct batchmeans *bm, double t, double latency)
+{
+  bm->latsum += latency;
+  if (++bm->count < bm->size)
+    return 0;
+
+  if (bm->n == bm->allocated) {
+    bm->allocated = bm->allocated ? 2 * bm->allocated : 256;
+    bm->lat = realloc(bm->lat, bm->allocated * sizeof(double));
+    bm->span = realloc(bm->span, bm->allocated * sizeof(double));
+    bm->begin = realloc(bm->begin, bm->allocated * sizeof(double));
+    if (bm->lat == NULL || bm->span == NULL || bm->begin == NULL) {
+      printf("memory allocation for batch means failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  bm->lat[bm->n] = bm->latsum / bm->size;
+  bm->span[bm->n] = t - bm->start;
+  bm->begin[bm->n] = bm->start;
+  bm->n++;
+  bm->count = 0;
+  bm->latsum = 0.0;
+  bm->start = t;
+
+  if (bm->n < bm->nextcheck)
+    return 0;
+  bm->nextcheck = bm->n + bm->n / 4;
+  return 1;
+}
+
+/* MSER truncation point of the series x[0..n-1] */
+static int mser(const double *x, int n)
+{
+  double sum = 0.0, sumsq = 0.0, stat, best = 0.0;
+  int d, bestd = 0;
+
+  /* walk d downwards so the suffix sums can be accumulated */
+  for (d = n - 1; d >= 0; d--) {
+    sum += x[d];
+    sumsq += x[d] * x[d];
+    if (d > n / 2)
+      continue;
+    stat = (sumsq - sum * sum / (n - d)) / ((double)(n - d) * (n - d));
+    if (d == n / 2 || stat <= best) {
+      best = stat;
+      bestd = d;
+    }
+  }
+  return bestd;
+}
+
+/* recompute warm-up and confidence intervals.  Returns 0 if there are
+   not yet enough mini-batches past the warm-up */
+int bm_estimate(struct batchmeans *bm)
+{
+  double *rate;
+  double gsum = 0.0, gsumsq = 0.0, lsum = 0.0, lsumsq = 0.0;
+  double g, l, t, var;
+  int d, dg, first, per, i, j;
+
+  if (bm->n < 2 * BM_BATCHES)
+    return 0;
+
+  /* warm-up is whichever of the two series settles later */
+  rate = malloc(bm->n * sizeof(double));
+  if (rate == NULL) {
+    printf("memory allocation for batch means failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < bm->n; i++)
+    rate[i] = bm->span[i] > 0.0 ? bm->size / bm->span[i] : 0.0;
+  d = mser(bm->lat, bm->n);
+  dg = mser(rate, bm->n);
+  free(rate);
+  if (dg > d)
+    d = dg;
+
+  per = (bm->n - d) / BM_BATCHES;
+  if (per < 1)
+    return 0;
+  first = bm->n - per * BM_BATCHES;   /* leftovers join the warm-up */
+  bm->warmup = first;
+
+  for (i = 0; i < BM_BATCHES; i++) {
+    l = t = 0.0;
+    for (j = first + i * per; j < first + (i + 1) * per; j++) {
+      l += bm->lat[j];
+      t += bm->span[j];
+    }
+    l /= per;
+    g = t > 0.0 ? (double)per * bm->size / t : 0.0;
+    lsum += l;
+    lsumsq += l * l;
+    gsum += g;
+    gsumsq += g * g;
+  }
+  bm->latency = lsum / BM_BATCHES;
+  bm->goodput = gsum / BM_BATCHES;
+  var = (lsumsq - lsum * lsum / BM_BATCHES) / (BM_BATCHES - 1);
+  bm->latency_hw = T_975 * sqrt(var > 0.0 ? var : 0.0) / sqrt(BM_BATCHES);
+  var = (gsumsq - gsum * gsum / BM_BATCHES) / (BM_BATCHES - 1);
+  bm->goodput_hw = T_975 * sqrt(var > 0.0 ? var : 0.0) / sqrt(BM_BATCHES);
+  return 1;
+}
+
+/* have both intervals reached the relative precision? */
+int bm_converged(struct batchmeans *bm, double precision)
+{
+  if (!bm_estimate(bm))
+    return 0;
+  return (bm->goodput > 0.0 && bm->goodput_hw <= precision * bm->goodput &&
+          bm->latency > 0.0 && bm->latency_hw <= precision * bm->latency);
+}
+
+void bm_report(struct batchmeans *bm, double precision)
+{
+  if (!bm_estimate(bm)) {
+    printf("too few deliveries for batch means: %d mini-batches of %d, need %d\n",
+           bm->n, bm->size, 2 * BM_BATCHES);
+    return;
+  }
+  printf("warm-up removed:  %d deliveries, up to time %f \n",
+         bm->warmup * bm->size, bm->begin[bm->warmup]);
+  printf("batch means:  %d batches of %d deliveries \n",
+         BM_BATCHES, (bm->n - bm->warmup) / BM_BATCHES * bm->size);
+  printf("goodput (messages delivered per time unit):  %f +/- %f (95%%, relative %.4f) \n",
+         bm->goodput, bm->goodput_hw, bm->goodput > 0.0 ? bm->goodput_hw / bm->goodput : 0.0);
+  printf("mean latency (generation to delivery):  %f +/- %f (95%%, relative %.4f) \n",
+         bm->latency, bm->latency_hw, bm->latency > 0.0 ? bm->latency_hw / bm->latency : 0.0);
+  printf("requested relative precision:  %.4f \n", precision);
+}
+
+/* ******************************************************************
+   Latency distribution.  Values below LH_SUB have a bucket each; above
+   that, a value with its highest bit at position e falls in one of
+   LH_SUB buckets splitting [2^e, 2^(e+1)), chosen by the next four bits.
+**********************************************************************/
+
+void lh_init(struct lathist *h)
+{
+  int i;
+
+  h->count = 0;
+  h->max = 0;
+  for (i = 0; i < LH_BUCKETS; i++)
+    h->bucket[i] = 0;
+}
+
+static int lh_index(long long v)
+{
+  int e;
+
+  if (v < LH_SUB)
+    return (int)v;
+  e = 63 - __builtin_clzll((unsigned long long)v);
+  return ((e - 3) * LH_SUB + (int)((v >> (e - 4)) & (LH_SUB - 1)));
+}
+
+/* smallest value that falls in bucket i */
+static long long lh_low(int i)
+{
+  int e;
+
+  if (i < LH_SUB)
+    return i;
+  e = i / LH_SUB + 3;
+  return ((long long)(LH_SUB + i % LH_SUB) << (e - 4));
+}
+
+void lh_add(struct lathist *h, long long v)
+{
+  if (v < 0)
+    v = 0;
+  h->bucket[lh_index(v)]++;
+  h->count++;
+  if (v > h->max)
+    h->max = v;
+}
+
+/* the value below which a fraction q of the recorded values lie: the
+   middle of the bucket holding it, and never above the maximum */
+long long lh_quantile(struct lathist *h, double q)
+{
+  long long rank, seen = 0, mid;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+  rank = (long long)(q * h->count);
+  if (rank >= h->count)
+    rank = h->count - 1;
+  for (i = 0; i < LH_BUCKETS; i++) {
+    seen += h->bucket[i];
+    if (seen > rank)
+      break;
+  }
+  mid = (lh_low(i) + (i + 1 < LH_BUCKETS ? lh_low(i + 1) : h->max + 1) - 1) / 2;
+  return (mid < h->max ? mid : h->max);
+}
+
+/* ******************************************************************
+   Independent replications.  Each run contributes one value, and the
+   mean of n values gets a 95% interval from Student's t with n - 1
+   degrees of freedom: tabulated up to 30, approximated beyond.
+**********************************************************************/
+
+static const double t975[30] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+void rp_init(struct replications *r)
+{
+  r->n = 0;
+  r->sum = r->sumsq = 0.0;
+}
+
+void rp_add(struct replications *r, double x)
+{
+  r->n++;
+  r->sum += x;
+  r->sumsq += x * x;
+}
+
+double rp_mean(struct replications *r)
+{
+  return (r->n > 0 ? r->sum / r->n : 0.0);
+}
+
+/* half width of the 95% interval for the mean, 0 with fewer than two values */
+double rp_halfwidth(struct replications *r)
+{
+  double var;
+  int df = r->n - 1;
+
+  if (df < 1)
+    return 0.0;
+  var = (r->sumsq - r->sum * r->sum / r->n) / df;
+  if (var < 0.0)
+    var = 0.0;
+  return ((df <= 30 ? t975[df - 1] : 1.960 + 2.4 / df) * sqrt(var / r->n));
+}
@@ -0,0 +1,54 @@
+/* output analysis for the emulator: batch means with warm-up removal */
+
+#define BM_BATCHES 30     /* number of batches the confidence intervals use */
+
+struct batchmeans {
+  int size;               /* deliveries per mini-batch */
+  int count;              /* deliveries in the current mini-batch */
+  double latsum;          /* latency summed over the current mini-batch */
+  double start;           /* time the current mini-batch started */
+  double *lat;            /* mean latency of each completed mini-batch */
+  double *span;           /* length in time of each completed mini-batch */
+  double *begin;          /* time each completed mini-batch started */
+  int n, allocated;       /* completed mini-batches, room for them */
+  int nextcheck;          /* mini-batches needed before the next test */
+
+  /* result of the last test */
+  int warmup;             /* mini-batches discarded as warm-up */
+  double goodput, goodput_hw;   /* deliveries per time unit, CI half width */
+  double latency, latency_hw;   /* mean latency, CI half width */
+};
+
+extern void bm_init(struct batchmeans *, int);
+extern void bm_free(struct batchmeans *);
+extern int bm_add(struct batchmeans *, double, double);
+extern int bm_estimate(struct batchmeans *);
+extern int bm_converged(struct batchmeans *, double);
+extern void bm_report(struct batchmeans *, double);
+
+/* latency distribution: log-spaced buckets over non-negative integer values,
+   16 buckets to each doubling, so quantiles are within 1/16 of the truth */
+#define LH_SUB     16
+#define LH_BUCKETS ((64 - 4) * LH_SUB)
+
+struct lathist {
+  long long count;        /* values recorded */
+  long long max;          /* largest value recorded */
+  long long bucket[LH_BUCKETS];
+};
+
+extern void lh_init(struct lathist *);
+extern void lh_add(struct lathist *, long long);
+extern long long lh_quantile(struct lathist *, double);
+
+/* independent replications: one value of a measure from each of n runs
+   with different seeds, and a Student t interval for its mean */
+struct replications {
+  int n;                  /* values added */
+  double sum, sumsq;      /* their sum and sum of squares */
+};
+
+extern void rp_init(struct replications *);
+extern void rp_add(struct replications *, double);
+extern double rp_mean(struct replications *);
+extern double rp_halfwidth(struct replications *);
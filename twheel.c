@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include "twheel.h"
+
+/* ******************************************************************
+   Hierarchical timing wheel.
+
+   Level L has TW_SLOTS slots, indexed by bits [L*TW_BITS, (L+1)*TW_BITS)
+   of the expiry time.  A timer is filed at the level of the highest
+   digit in which its expiry differs from the wheel's current time, in
+   the slot given by that digit of its expiry.  So level 0 holds timers
+   due within the current TW_SLOTS ticks, one slot per tick, and every
+   timer at a level L > 0 lies in a slot beyond the current digit.
+
+   Arming and cancelling are O(1).  When the wheel advances into a slot
+   of a higher level, that slot's timers are refiled lower down; a timer
+   moves at most TW_LEVELS times in its life.  Bitmaps of non-empty
+   slots let the wheel skip idle time without stepping tick by tick.
+   Timers due at the same tick fire in a deterministic order.
+**********************************************************************/
+
+void tw_init(struct twheel *w, long long now)
+{
+  memset(w, 0, sizeof(struct twheel));
+  w->now = now;
+}
+
+static void file(struct twheel *w, struct twtimer *t)
+{
+  unsigned long long diff = (unsigned long long)(t->expiry ^ w->now);
+  int level = 0, slot;
+
+  if (diff != 0)
+    level = (63 - __builtin_clzll(diff)) / TW_BITS;
+  slot = (int)((t->expiry >> (level * TW_BITS)) & (TW_SLOTS - 1));
+
+  t->level = level;
+  t->slot = slot;
+  t->next = NULL;
+  t->prev = w->tail[level][slot];
+  if (t->prev != NULL)
+    t->prev->next = t;
+  else
+    w->head[level][slot] = t;
+  w->tail[level][slot] = t;
+  w->used[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+static void unfile(struct twheel *w, struct twtimer *t)
+{
+  int level = t->level, slot = t->slot;
+
+  if (t->prev != NULL)
+    t->prev->next = t->next;
+  else
+    w->head[level][slot] = t->next;
+  if (t->next != NULL)
+    t->next->prev = t->prev;
+  else
+    w->tail[level][slot] = t->prev;
+  if (w->head[level][slot] == NULL)
+    w->used[level][slot / 64] &= ~(1ULL << (slot % 64));
+  t->level = -1;
+}
+
+/* arm timer t to fire at tick expiry; times in the past fire at once */
+void tw_add(struct twheel *w, struct twtimer *t, long long expiry)
+{
+  t->expiry = expiry < w->now ? w->now : expiry;
+  file(w, t);
+  w->count++;
+}
+
+void tw_cancel(struct twheel *w, struct twtimer *t)
+{
+  if (t->level < 0)
+    return;
+  unfile(w, t);
+  w->count--;
+}
+
+/* first non-empty slot at or after slot from, or -1 */
+static int nextused(struct twheel *w, int level, int from)
+{
+  unsigned long long bits;
+  int word;
+
+  for (word = from / 64; word < TW_SLOTS / 64; word++) {
+    bits = w->used[level][word];
+    if (word == from / 64)
+      bits &= ~0ULL << (from % 64);
+    if (bits != 0)
+      return word * 64 + __builtin_ctzll(bits);
+  }
+  return -1;
+}
+
+/* find the earliest non-empty slot.  Returns the tick at which that slot
+   begins, which is the exact expiry of its timers at level 0 and a lower
+   bound at higher levels */
+static long long earliest(struct twheel *w, int *levelp, int *slotp)
+{
+  unsigned long long now = (unsigned long long)w->now, high;
+  int level, digit, slot, shift;
+
+  for (level = 0; level < TW_LEVELS; level++) {
+    shift = level * TW_BITS;
+    digit = (int)((now >> shift) & (TW_SLOTS - 1));
+    slot = nextused(w, level, level == 0 ? digit : digit + 1);
+    if (slot >= 0) {
+      *levelp = level;
+      *slotp = slot;
+      high = level == TW_LEVELS - 1 ? 0 : now >> (shift + TW_BITS) << (shift + TW_BITS);
+      return (long long)(high | ((unsigned long long)slot << shift));
+    }
+  }
+  return TW_NEVER;
+}
+
+/* lower bound on the earliest expiry, exact when that timer is due within
+   the current TW_SLOTS ticks.  TW_NEVER if no timer is armed */
+long long tw_next(struct twheel *w)
+{
+  int level, slot;
+
+  if (w->count == 0)
+    return TW_NEVER;
+  return earliest(w, &level, &slot);
+}
+
+/* remove and return the earliest timer if it is due no later than limit,
+   advancing the wheel's time to its expiry; NULL otherwise */
+struct twtimer *tw_pop(struct twheel *w, long long limit)
+{
+  struct twtimer *t, *next;
+  long long at;
+  int level, slot;
+
+  while (w->count > 0) {
+    at = earliest(w, &level, &slot);
+    if (at > limit)
+      return NULL;
+    w->now = at;
+    t = w->head[level][slot];
+    if (level == 0) {
+      unfile(w, t);
+      w->count--;
+      return t;
+    }
+    /* the wheel has entered a higher-level slot: refile its timers
+       relative to the new time, which moves them to lower levels */
+    for (; t != NULL; t = next) {
+      next = t->next;
+      unfile(w, t);
+      file(w, t);
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,28 @@
+/* hierarchical timing wheel: many timers, O(1) arm and cancel */
+
+#define TW_BITS   8                   /* bits of the expiry time per level */
+#define TW_SLOTS  (1 << TW_BITS)      /* slots per level */
+#define TW_LEVELS (64 / TW_BITS)      /* levels needed for 64-bit times */
+#define TW_NEVER  0x7fffffffffffffffLL
+
+/* a timer.  The owner fields are not used by the wheel */
+struct twtimer {
+  long long expiry;           /* tick at which the timer fires */
+  int flow, entity, id;       /* who started it */
+  int level, slot;            /* where it is filed, level -1 if not armed */
+  struct twtimer *prev, *next;
+};
+
+struct twheel {
+  long long now;              /* timers are filed relative to this tick */
+  long count;                 /* armed timers */
+  struct twtimer *head[TW_LEVELS][TW_SLOTS];
+  struct twtimer *tail[TW_LEVELS][TW_SLOTS];
+  unsigned long long used[TW_LEVELS][TW_SLOTS / 64];  /* non-empty slots */
+};
+
+extern void tw_init(struct twheel *, long long);
+extern void tw_add(struct twheel *, struct twtimer *, long long);
+extern void tw_cancel(struct twheel *, struct twtimer *);
+extern struct twtimer *tw_pop(struct twheel *, long long);
+extern long long tw_next(struct twheel *);
@@ -0,0 +1,540 @@
+/* ******************************************************************
+   REAL-TIME UDP BACKEND
+
+   An alternative to emulator.c that runs the same protocol code (gbn.c
+   or sr.c) against the wall clock.  A and B are two UDP sockets on
+   127.0.0.1, connected to each other, and one thread waits on both of
+   them and on a timerfd with epoll:
+   - tolayer3() sends the packet as a datagram, after optionally losing
+   or corrupting it in software exactly as the emulator does.
+   - a datagram arriving at A or B is passed to A_input()/B_input().
+   - starttimer()/starttimer_id() arm timers in a timing wheel (twheel.c)
+   ticking in nanoseconds; the timerfd is set to the earliest of them.
+   - messages are offered to A_output() at the requested mean interval
+   (uniform on [0, 2*lambda], as in the emulator), or with lambda 0 as
+   fast as A accepts them: after a refusal, the next message waits until
+   A has taken in a packet or a timer.
+
+   One time unit, as used by the prompts and by starttimer(), is a number
+   of microseconds given at start-up.  The run ends once nsimmax messages
+   have been offered and every accepted one has been delivered, and
+   reports messages per second and the wall-clock latency from
+   acceptance at A to delivery at B.
+
+   Linux only.  Build with
+       gcc -O2 -o gbn-udp udpemu.c twheel.c gbn.c -lm
+**********************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "emulator.h"
+#include "gbn.h"
+#include "twheel.h"
+
+#if MULTIFLOW || AUTOSTOP || PARALLEL
+#error "the UDP backend runs a single flow in real time"
+#endif
+
+int TRACE = 0;
+
+/* statistics updated by GBN */
+long long window_full;
+long long total_ACKs_received;
+long long packets_resent;
+long long new_ACKs;
+long long packets_received;
+long long packets_recovered;
+long long packets_refused;
+long long buffer_peak;
+
+int nflows = 1;
+int curflow = 0;
+
+/* statistics updated by the backend */
+static long long messages_delivered;
+static long long nsim = 0;        /* messages offered to A so far */
+static long long nsimmax = 0;     /* number of msgs to offer, then stop */
+static long long naccepted = 0;   /* messages A took */
+static long long ntolayer3;       /* number sent into layer 3 */
+static long long nlost;           /* number lost in software */
+static long long ncorrupt;        /* number corrupted in software */
+static long long nsendfail;       /* datagrams the kernel would not take */
+
+static float lossprob;            /* probability that a packet is dropped  */
+static float corruptprob;         /* probability that one bit is packet is flipped */
+static int corruptdirection;      /* A->B A<-B or bidirectional corruption/loss */
+static float lambda;              /* mean time between messages, 0 = saturate */
+static double usperunit;          /* microseconds in one time unit */
+
+static int sock[2];               /* UDP sockets of A and B */
+static int tfd;                   /* timerfd, set to the next timer or arrival */
+static simtime_t now;             /* nanoseconds since the start */
+static struct timespec start;     /* wall-clock time of the start */
+
+static struct twheel wheel;       /* running timers */
+static struct twtimer *twfree;    /* unused timers */
+static struct twtimer *timer[2];  /* running starttimer() timer of A and B */
+static struct twtimer **idtimer[2];  /* running starttimer_id() timers, by id */
+static int nidtimer[2];           /* size of idtimer[] */
+
+/* acceptance times of undelivered messages, delivered in this order */
+static simtime_t *gentime;
+static int ghead, gcount, gsize;
+static double latsum, latmax;     /* wall-clock latency, nanoseconds */
+
+/* time units are scaled to nanoseconds of wall-clock time */
+simtime_t units2ticks(double units)
+{
+  return ((simtime_t)(units * usperunit * 1000.0 + 0.5));
+}
+
+double ticks2units(simtime_t ticks)
+{
+  return ((double)ticks / (usperunit * 1000.0));
+}
+
+static simtime_t clocknow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((simtime_t)(ts.tv_sec - start.tv_sec) * 1000000000LL + (ts.tv_nsec - start.tv_nsec));
+}
+
+double jimsrand(void)
+{
+  double mmm = RAND_MAX;
+  return (rand() / mmm);
+}
+
+/* open A's and B's sockets on the loopback address and connect them to
+   each other */
+static void opensockets(void)
+{
+  struct sockaddr_in addr[2];
+  socklen_t len = sizeof(struct sockaddr_in);
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    sock[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock[i] < 0) {
+      perror("socket");
+      exit(EXIT_FAILURE);
+    }
+    memset(&addr[i], 0, sizeof(struct sockaddr_in));
+    addr[i].sin_family = AF_INET;
+    addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr[i].sin_port = 0;
+    if (bind(sock[i], (struct sockaddr *)&addr[i], len) < 0 ||
+        getsockname(sock[i], (struct sockaddr *)&addr[i], &len) < 0) {
+      perror("bind");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < 2; i++)
+    if (connect(sock[i], (struct sockaddr *)&addr[1-i], len) < 0) {
+      perror("connect");
+      exit(EXIT_FAILURE);
+    }
+}
+
+void init(void)
+{
+  printf("-----  Real-time UDP loopback backend -------- \n\n");
+  printf("Enter the number of messages to send: ");
+  scanf("%lld",&nsimmax);
+  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+  scanf("%f",&lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%f",&corruptprob);
+  if (lossprob != 0.0 || corruptprob != 0.0) {
+    printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
+    scanf("%d",&corruptdirection);
+  }
+  printf("Enter average time between messages from sender's layer5 [0.0 to send as fast as A accepts]:");
+  scanf("%f",&lambda);
+  printf("Enter the length of a time unit in microseconds [e.g. 1000]:");
+  scanf("%lf",&usperunit);
+  printf("Enter TRACE:");
+  scanf("%d",&TRACE);
+
+  if (nsimmax < 0 || lambda < 0.0 || usperunit <= 0.0) {
+    printf("Invalid message count, arrival time or time unit.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  srand(9999);
+  tw_init(&wheel, 0);
+  opensockets();
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (tfd < 0) {
+    perror("timerfd_create");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+static struct twtimer **timerslot(int AorB, int id)
+{
+  int i, n;
+
+  if (id < 0)
+    return (&timer[AorB]);
+  if (id >= nidtimer[AorB]) {
+    n = nidtimer[AorB] ? nidtimer[AorB] : 8;
+    while (n <= id)
+      n *= 2;
+    idtimer[AorB] = realloc(idtimer[AorB], n * sizeof(struct twtimer *));
+    if (idtimer[AorB] == 0) {
+      printf("memory allocation for timers failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i = nidtimer[AorB]; i < n; i++)
+      idtimer[AorB][i] = NULL;
+    nidtimer[AorB] = n;
+  }
+  return (&idtimer[AorB][id]);
+}
+
+static void armtimer(int AorB, int id, double increment)
+{
+  struct twtimer **slot = timerslot(AorB, id);
+  struct twtimer *t;
+
+  if (*slot != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  t = twfree;
+  if (t != NULL)
+    twfree = t->next;
+  else if ((t = malloc(sizeof(struct twtimer))) == 0) {
+    printf("memory allocation for timers failed.");
+    exit(EXIT_FAILURE);
+  }
+  t->flow = 0;
+  t->entity = AorB;
+  t->id = id;
+  *slot = t;
+  tw_add(&wheel, t, clocknow() + units2ticks(increment));
+}
+
+static void disarmtimer(int AorB, int id)
+{
+  struct twtimer **slot = timerslot(AorB, id);
+
+  if (*slot == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  tw_cancel(&wheel, *slot);
+  (*slot)->next = twfree;
+  twfree = *slot;
+  *slot = NULL;
+}
+
+void stoptimer(int AorB)
+{
+  disarmtimer(AorB, -1);
+}
+
+void starttimer(int AorB, double increment)
+{
+  armtimer(AorB, -1, increment);
+}
+
+void stoptimer_id(int AorB, int id)
+{
+  disarmtimer(AorB, id);
+}
+
+void starttimer_id(int AorB, int id, double increment)
+{
+  if (id < 0) {
+    printf("Warning: timer ids must not be negative\n");
+    return;
+  }
+  armtimer(AorB, id, increment);
+}
+
+static void timerinterrupt(struct twtimer *t)
+{
+  int AorB = t->entity, id = t->id;
+
+  if (TRACE>=2)
+    printf("\nTIMER: entity %d, id %d at %f\n", AorB, id, ticks2units(now));
+  *timerslot(AorB, id) = NULL;
+  t->next = twfree;
+  twfree = t;
+
+  if (id < 0) {
+    if (AorB == A)
+      A_timerinterrupt();
+    else
+      B_timerinterrupt();
+  }
+  else {
+    if (AorB == A)
+      A_timerinterrupt_id(id);
+    else
+      B_timerinterrupt_id(id);
+  }
+}
+
+static void pushgentime(simtime_t t)
+{
+  int i;
+  simtime_t *grown;
+
+  if (gcount == gsize) {
+    grown = malloc((gsize ? 2 * gsize : 8) * sizeof(simtime_t));
+    if (grown == 0) {
+      printf("memory allocation for generation times failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < gcount; i++)
+      grown[i] = gentime[(ghead + i) % gsize];
+    free(gentime);
+    gentime = grown;
+    ghead = 0;
+    gsize = gsize ? 2 * gsize : 8;
+  }
+  gentime[(ghead + gcount) % gsize] = t;
+  gcount++;
+}
+
+/************************** TOLAYER3 ***************/
+void tolayer3(int AorB, struct pkt packet)
+{
+  float x;
+
+  ntolayer3++;
+
+  /* simulate losses: */
+  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+    nlost++;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being lost\n");
+    return;
+  }
+
+  /* simulate corruption: */
+  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+    ncorrupt++;
+    if ( (x = jimsrand()) < .75)
+      packet.payload[0]='Z';   /* corrupt payload */
+    else if (x < .875)
+      packet.seqnum = 999999;
+    else
+      packet.acknum = 999999;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being corrupted\n");
+  }
+
+  /* a full socket buffer loses the datagram, as a full queue would */
+  if (send(sock[AorB], &packet, sizeof(struct pkt), 0) != sizeof(struct pkt)) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+      perror("send");
+      exit(EXIT_FAILURE);
+    }
+    nsendfail++;
+  }
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  double latency;
+  int i;
+
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at %c: ", AorB == A ? 'A' : 'B');
+    for (i=0; i<20; i++)
+      printf("%c",datasent[i]);
+    printf("\n");
+  }
+  messages_delivered++;
+  if (gcount > 0) {
+    latency = (double)(clocknow() - gentime[ghead]);
+    ghead = (ghead + 1) % gsize;
+    gcount--;
+    latsum += latency;
+    if (latency > latmax)
+      latmax = latency;
+  }
+}
+
+/* offer the next message to A.  Returns 0 if A refused it */
+static int offer(void)
+{
+  struct msg msg2give;
+  long long refused = window_full;
+  int i;
+
+  for (i=0; i<20; i++)
+    msg2give.data[i] = 97 + nsim % 26;
+  nsim++;
+  A_output(msg2give);
+  if (window_full != refused)
+    return 0;
+  naccepted++;
+  pushgentime(clocknow());
+  return 1;
+}
+
+/* take in every datagram waiting at entity AorB */
+static void receive(int AorB)
+{
+  struct pkt packet;
+  ssize_t n;
+
+  while ((n = recv(sock[AorB], &packet, sizeof(struct pkt), 0)) == sizeof(struct pkt)) {
+    now = clocknow();
+    if (AorB == A)
+      A_input(packet);
+    else
+      B_input(packet);
+  }
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("recv");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* set the timerfd to go off at tick due, or disarm it */
+static void settimerfd(simtime_t due)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (due != TW_NEVER) {
+    due += (simtime_t)start.tv_sec * 1000000000LL + start.tv_nsec;
+    if (due <= 0)
+      due = 1;
+    its.it_value.tv_sec = due / 1000000000LL;
+    its.it_value.tv_nsec = due % 1000000000LL;
+  }
+  if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    perror("timerfd_settime");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void run(void)
+{
+  struct epoll_event ev, events[3];
+  struct twtimer *t;
+  simtime_t nextarrival = 0, due;
+  unsigned long long expirations;
+  int ep, i, n, blocked = 0;
+
+  ep = epoll_create1(0);
+  if (ep < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < 3; i++) {
+    ev.events = EPOLLIN;
+    ev.data.fd = i < 2 ? sock[i] : tfd;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+      perror("epoll_ctl");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  while (nsim < nsimmax || messages_delivered < naccepted) {
+    /* expired timers */
+    now = clocknow();
+    while ((t = tw_pop(&wheel, now)) != NULL) {
+      if (t->entity == A)
+        blocked = 0;
+      timerinterrupt(t);
+    }
+
+    /* new messages */
+    if (lambda > 0.0) {
+      while (nsim < nsimmax && nextarrival <= now) {
+        offer();
+        nextarrival += units2ticks(lambda * jimsrand() * 2);
+      }
+    }
+    else {
+      while (nsim < nsimmax && !blocked)
+        blocked = !offer();
+    }
+
+    due = tw_next(&wheel);
+    if (lambda > 0.0 && nsim < nsimmax && nextarrival < due)
+      due = nextarrival;
+    settimerfd(due);
+
+    n = epoll_wait(ep, events, 3, -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == tfd) {
+        if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+          perror("read timerfd");
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (events[i].data.fd == sock[A]) {
+        receive(A);
+        blocked = 0;
+      }
+      else
+        receive(B);
+    }
+  }
+  close(ep);
+}
+
+int main(void)
+{
+  double elapsed;
+
+  init();
+  A_init();
+  B_init();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  run();
+  elapsed = clocknow() / 1e9;
+
+  printf(" Run ended after %f seconds (%f time units)\n after attempting to send %lld msgs from layer5\n",
+         elapsed, ticks2units(now), nsim);
+  printf("number of messages dropped due to full window:  %lld \n", window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %lld \n", new_ACKs);
+  printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
+  printf("number of packet resends by A:  %lld \n", packets_resent);
+  printf("number of correct packets received at B:  %lld \n", packets_received);
+  if (FEC > 0)
+    printf("number of packets rebuilt from parity at B:  %lld \n", packets_recovered);
+  if (RCVBUF > 0) {
+    printf("number of packets dropped for a full receive buffer at B:  %lld \n", packets_refused);
+    printf("most messages waiting in a receive buffer:  %lld (%lld bytes) \n", buffer_peak, 20 * buffer_peak);
+  }
+  printf("number of messages delivered to application:  %lld \n", messages_delivered);
+  printf("number of packets sent into layer 3:  %lld \n", ntolayer3);
+  printf("number of packets lost, corrupted in software:  %lld, %lld \n", nlost, ncorrupt);
+  printf("number of datagrams the socket would not take:  %lld \n", nsendfail);
+  printf("messages delivered per second:  %.0f \n", elapsed > 0 ? messages_delivered / elapsed : 0.0);
+  if (messages_delivered > 0)
+    printf("wall-clock latency, acceptance to delivery (microseconds): mean %.2f, max %.2f \n",
+           latsum / messages_delivered / 1000.0, latmax / 1000.0);
+  close(sock[A]);
+  close(sock[B]);
+  close(tfd);
+  return EXIT_SUCCESS;
+}